@@ -0,0 +1,196 @@
+#include "bencode.h"
+#include "byte_tools.h"
+#include "message.h"
+#include "piece.h"
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+
+/*
+ * Микро-бенчмарки горячих мест клиента.
+ * Запуск: ./torrent-client-benchmarks [путь к torrent-файлу] [количество итераций]
+ */
+
+namespace {
+    template <class Func>
+    double MeasureMicroseconds(size_t iterations, Func&& func) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            func();
+        }
+        auto finish = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::micro>(finish - start).count() / iterations;
+    }
+
+    void Report(const std::string& name, double oldTime, double newTime) {
+        std::cout << name << ": old " << oldTime << " us, new " << newTime << " us, speedup x"
+                  << oldTime / newTime << std::endl;
+    }
+
+    void BenchmarkBencode(const std::string& data, size_t iterations) {
+        size_t checksum = 0;
+
+        double oldParse = MeasureMicroseconds(iterations, [&]() {
+            std::string copy = data;
+            size_t cur_pos = 0;
+            auto dict = std::dynamic_pointer_cast<NodeDict>(Bencode::Parse(cur_pos, copy.size(), copy));
+            checksum += cur_pos;
+        });
+        double newParse = MeasureMicroseconds(iterations, [&]() {
+            Bencode::Document document(data);
+            checksum += document.ParsedSize();
+        });
+        Report("bencode parse", oldParse, newParse);
+
+        double oldInfoHash = MeasureMicroseconds(iterations, [&]() {
+            std::string copy = data;
+            size_t cur_pos = 0;
+            auto dict = std::dynamic_pointer_cast<NodeDict>(Bencode::Parse(cur_pos, copy.size(), copy));
+            checksum += Bencode::GetInfoHash(dict).size();
+        });
+        double newInfoHash = MeasureMicroseconds(iterations, [&]() {
+            Bencode::Document document(data);
+            checksum += Bencode::GetInfoHash(document).size();
+        });
+        Report("bencode parse + info hash", oldInfoHash, newInfoHash);
+
+        std::cout << "(checksum " << checksum << ")" << std::endl;
+    }
+
+    /*
+     * Прежняя реализация Message: payload копируется при разборе, а при кодировании собирается из строк
+     */
+    struct LegacyMessage {
+        MessageId id;
+        size_t messageLength;
+        std::string payload;
+
+        static LegacyMessage Parse(const std::string& messageString) {
+            return {static_cast<MessageId>(messageString[0]), messageString.length(),
+                    messageString.substr(1, messageString.length() - 1)};
+        }
+
+        static LegacyMessage Init(MessageId id, const std::string& payload) {
+            return {id, payload.length() + 1, payload};
+        }
+
+        static LegacyMessage InitBlockMessage(MessageId id, size_t pieceIndex, size_t offset, size_t length) {
+            return Init(id, IntToBytes(pieceIndex) + IntToBytes(offset) + IntToBytes(length));
+        }
+
+        std::string ToString() const {
+            return IntToBytes(messageLength) + static_cast<char>(id) + payload;
+        }
+    };
+
+    /*
+     * Разбор сообщений Piece и Have и кодирование Request и Have: прежний путь через строки против разбора
+     * на месте и записи в готовый буфер
+     */
+    void BenchmarkMessages(size_t iterations) {
+        constexpr size_t blockSize = 1 << 14;
+        std::string piece = std::string(1, static_cast<char>(MessageId::Piece)) + IntToBytes(7) + IntToBytes(blockSize) +
+                std::string(blockSize, 'x');
+        std::string have = std::string(1, static_cast<char>(MessageId::Have)) + IntToBytes(123);
+        size_t checksum = 0;
+
+        double oldParse = MeasureMicroseconds(iterations, [&]() {
+            // так разбирал сообщения основной цикл: копия сообщения из сокета, затем substr на каждое поле
+            std::string received = piece;
+            LegacyMessage message = LegacyMessage::Parse(received);
+            std::string data = message.payload;
+            checksum += BytesToInt(data.substr(0, 4)) + BytesToInt(data.substr(4, 4)) + data.substr(8).size();
+            LegacyMessage haveMessage = LegacyMessage::Parse(have);
+            checksum += BytesToInt(haveMessage.payload.substr(0, 4));
+        });
+        double newParse = MeasureMicroseconds(iterations, [&]() {
+            Message message = Message::Parse(piece);
+            checksum += message.PieceIndex() + message.BlockOffset() + message.BlockData().size();
+            checksum += Message::Parse(have).PieceIndex();
+        });
+        Report("parse piece + have messages", oldParse, newParse);
+
+        std::string output;
+        double oldEncode = MeasureMicroseconds(iterations, [&]() {
+            output.clear();
+            for (uint32_t i = 0; i < 16; ++i) {
+                output += LegacyMessage::InitBlockMessage(MessageId::Request, i, i * blockSize, blockSize).ToString();
+                output += LegacyMessage::Init(MessageId::Have, IntToBytes(i)).ToString();
+            }
+            checksum += output.size();
+        });
+        std::string buffer(16 * (Message::BLOCK_MESSAGE_SIZE + Message::HEADER_SIZE + 4), '\0');
+        double newEncode = MeasureMicroseconds(iterations, [&]() {
+            char* destination = buffer.data();
+            for (uint32_t i = 0; i < 16; ++i) {
+                Message::EncodeBlockMessage(destination, MessageId::Request, i, i * blockSize, blockSize);
+                destination += Message::BLOCK_MESSAGE_SIZE;
+                char index[4];
+                WriteUint32BigEndian(index, i);
+                Message have = Message::Init(MessageId::Have, std::string_view(index, sizeof(index)));
+                have.Encode(destination);
+                destination += have.EncodedSize();
+            }
+            checksum += destination - buffer.data();
+        });
+        Report("encode 16 request + 16 have messages", oldEncode, newEncode);
+        std::cout << "(checksum " << checksum << ")" << std::endl;
+    }
+
+    /*
+     * Сколько занимает проверка хеша после прихода последнего блока части: полный пересчет против потокового хеша,
+     * который уже посчитан по мере прихода блоков
+     */
+    void BenchmarkPieceHash(size_t pieceLength, size_t iterations) {
+        constexpr size_t blockSize = 1 << 14;
+        std::string data(pieceLength, '\0');
+        for (size_t i = 0; i < data.size(); ++i) {
+            data[i] = static_cast<char>(i * 7919 % 251);
+        }
+        Sha1Hash hash = CalculateSHA1Hash(data);
+        auto pool = std::make_shared<BufferPool>(pieceLength, 1);
+        Piece piece(0, pieceLength, hash, pool);
+
+        size_t matches = 0;
+        double fullHash = 0, incrementalHash = 0;
+        for (size_t i = 0; i < iterations; ++i) {
+            piece.Reset();
+            for (size_t offset = 0; offset < pieceLength; offset += blockSize) {
+                piece.SaveBlock(offset, std::string_view(data).substr(offset, blockSize));
+            }
+            fullHash += MeasureMicroseconds(1, [&]() {
+                matches += piece.GetDataHash() == hash;
+            });
+            incrementalHash += MeasureMicroseconds(1, [&]() {
+                matches += piece.HashMatches();
+            });
+        }
+        Report("piece hash check after last block (" + std::to_string(pieceLength >> 20) + " MiB)",
+               fullHash / iterations, incrementalHash / iterations);
+        std::cout << "(matches " << matches << ")" << std::endl;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::string path = argc > 1 ? argv[1] : "resources/debian-9.3.0-ppc64el-netinst.torrent";
+    size_t iterations = argc > 2 ? std::stoul(argv[2]) : 200;
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Cannot open " << path << std::endl;
+        return 1;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    std::string data = buffer.str();
+
+    std::cout << "Benchmarking on " << path << " (" << data.size() << " bytes), " << iterations
+              << " iterations" << std::endl;
+    BenchmarkBencode(data, iterations);
+    BenchmarkPieceHash(4 << 20, 20);
+    BenchmarkMessages(iterations * 1000);
+
+    return 0;
+}
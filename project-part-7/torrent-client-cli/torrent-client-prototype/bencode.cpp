@@ -1,4 +1,37 @@
 #include "bencode.h"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+    constexpr size_t MAX_DEPTH = 256;
+
+    /*
+     * Разобрать десятичное число из data[pos..), остановившись на символе `terminator`
+     */
+    int64_t ParseDecimal(std::string_view data, size_t& pos, char terminator) {
+        bool negative = false;
+        if (pos < data.size() && data[pos] == '-') {
+            negative = true;
+            ++pos;
+        }
+        size_t begin = pos;
+        uint64_t value = 0;
+        while (pos < data.size() && data[pos] >= '0' && data[pos] <= '9') {
+            uint64_t digit = data[pos] - '0';
+            if (value > (static_cast<uint64_t>(std::numeric_limits<int64_t>::max()) - digit) / 10) {
+                throw std::runtime_error("Integer is too big!");
+            }
+            value = value * 10 + digit;
+            ++pos;
+        }
+        if (pos == begin || pos >= data.size() || data[pos] != terminator) {
+            throw std::runtime_error("Bad integer!");
+        }
+        ++pos;
+        return negative ? -static_cast<int64_t>(value) : static_cast<int64_t>(value);
+    }
+}
 
 namespace Bencode {
     std::shared_ptr<Data> Parse(size_t& cur_pos, size_t len, std::string& data) {
@@ -56,6 +89,97 @@ namespace Bencode {
         }
     }
 
+    Document::Document(std::string_view data)
+            : data_(data) {
+        if (data_.empty()) {
+            throw std::runtime_error("Empty bencode data!");
+        }
+        size_t pos = 0;
+        ParseNode(pos, 0);
+    }
+
+    const NodeView& Document::Root() const {
+        return nodes_.front();
+    }
+
+    const NodeView* Document::Find(const NodeView& dict, std::string_view key) const {
+        if (dict.type != NodeView::Type::Dict) {
+            throw std::runtime_error("Node is not a dict!");
+        }
+        for (size_t i = IndexOf(dict) + 1; i < dict.end; i = nodes_[nodes_[i].end].end) {
+            if (nodes_[i].string == key) {
+                return &nodes_[nodes_[i].end];
+            }
+        }
+        return nullptr;
+    }
+
+    const NodeView& Document::Get(const NodeView& dict, std::string_view key) const {
+        const NodeView* value = Find(dict, key);
+        if (value == nullptr) {
+            throw std::runtime_error("Dict hasn't key " + std::string(key) + "!");
+        }
+        return *value;
+    }
+
+    size_t Document::ParsedSize() const {
+        return Root().raw.size();
+    }
+
+    size_t Document::IndexOf(const NodeView& node) const {
+        return &node - nodes_.data();
+    }
+
+    size_t Document::ParseNode(size_t& pos, size_t depth) {
+        if (depth > MAX_DEPTH) {
+            throw std::runtime_error("Bencode data is nested too deep!");
+        }
+        if (pos >= data_.size()) {
+            throw std::runtime_error("Index more than data length!");
+        }
+        size_t begin = pos;
+        size_t index = nodes_.size();
+        nodes_.emplace_back();
+        char type = data_[pos];
+        if (type == 'i') {
+            ++pos;
+            nodes_[index].type = NodeView::Type::Int;
+            nodes_[index].integer = ParseDecimal(data_, pos, 'e');
+        }
+        else if (type >= '0' && type <= '9') {
+            int64_t len = ParseDecimal(data_, pos, ':');
+            if (static_cast<uint64_t>(len) > data_.size() - pos) {
+                throw std::runtime_error("Index more than data length!");
+            }
+            nodes_[index].type = NodeView::Type::String;
+            nodes_[index].string = data_.substr(pos, len);
+            pos += len;
+        }
+        else if (type == 'l' || type == 'd') {
+            ++pos;
+            nodes_[index].type = (type == 'l' ? NodeView::Type::List : NodeView::Type::Dict);
+            while (pos < data_.size() && data_[pos] != 'e') {
+                if (type == 'd') {
+                    size_t key = ParseNode(pos, depth + 1);
+                    if (nodes_[key].type != NodeView::Type::String) {
+                        throw std::runtime_error("Dict key is not a string!");
+                    }
+                }
+                ParseNode(pos, depth + 1);
+            }
+            if (pos >= data_.size()) {
+                throw std::runtime_error("Index more than data length!");
+            }
+            ++pos;
+        }
+        else {
+            throw std::runtime_error("Unknown bencode type!");
+        }
+        nodes_[index].raw = data_.substr(begin, pos - begin);
+        nodes_[index].end = static_cast<uint32_t>(nodes_.size());
+        return index;
+    }
+
     std::vector<Peer> ParsePeers(const std::string& peers) {
         std::vector<Peer> res;
         for (size_t i = 0; i < peers.size(); i += 6) {
@@ -73,16 +197,14 @@ namespace Bencode {
         return res;
     }
 
-    std::vector<std::string> GetPieceHashes(const std::shared_ptr<NodeDict>& dict) {
-        std::string data = std::dynamic_pointer_cast<NodeString>(
-                std::dynamic_pointer_cast<NodeDict>(dict->GetKeyValue("info"))
-                        ->GetKeyValue("pieces"))->GetValue();
-
-        std::vector<std::string> result;
-        size_t piece_size = 20;
-        size_t len = data.size();
-        for (size_t i = 0; i < len; i += piece_size) {
-            result.push_back(data.substr(i, 20));
+    std::vector<Sha1Hash> GetPieceHashes(std::string_view pieces) {
+        Sha1Hash hash;
+        if (pieces.size() % hash.size() != 0) {
+            throw std::runtime_error("Bad length of pieces!");
+        }
+        std::vector<Sha1Hash> result(pieces.size() / hash.size());
+        for (size_t i = 0; i < result.size(); ++i) {
+            std::copy_n(pieces.data() + i * hash.size(), hash.size(), reinterpret_cast<char*>(result[i].data()));
         }
         return result;
     }
@@ -98,4 +220,13 @@ namespace Bencode {
         }
         return result;
     }
+
+    std::string GetInfoHash(const Document& document) {
+        std::string_view info = document.Get(document.Root(), "info").raw;
+
+        std::string result(SHA_DIGEST_LENGTH, '\0');
+        SHA1(reinterpret_cast<const unsigned char*>(info.data()), info.size(),
+             reinterpret_cast<unsigned char*>(result.data()));
+        return result;
+    }
 }
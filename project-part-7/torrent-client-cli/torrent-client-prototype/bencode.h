@@ -8,7 +8,10 @@
 #include <map>
 #include <sstream>
 #include <memory>
+#include <string_view>
+#include <cstdint>
 #include "peer.h"
+#include "byte_tools.h"
 #include <openssl/sha.h>
 
 class Data {
@@ -107,7 +110,86 @@ namespace Bencode {
  */
 
     std::shared_ptr<Data> Parse(size_t& cur_pos, size_t len, std::string& data);
+
+    /*
+     * Узел дерева, которое строит Document.
+     * Данные не копируются: строки -- это срезы исходного буфера, целые числа сразу разбираются в int64_t.
+     * В `raw` лежит весь отрезок исходного буфера, занимаемый узлом (например, "d...e" для словаря),
+     * поэтому узел можно хешировать без повторной сериализации.
+     */
+    struct NodeView {
+        enum class Type : uint8_t {
+            Int = 0,
+            String,
+            List,
+            Dict,
+        };
+
+        Type type;
+        int64_t integer = 0;  // значение узла типа Int
+        std::string_view string;  // значение узла типа String
+        std::string_view raw;  // байты исходного буфера, которые занимает узел
+        uint32_t end = 0;  // индекс первого узла после поддерева данного узла
+    };
+
+    /*
+     * Разобранный bencode-документ.
+     * Все узлы хранятся в одном векторе в порядке обхода в глубину: дети узла с индексом i лежат
+     * на отрезке (i, nodes[i].end), у словаря ключи и значения чередуются.
+     * Документ не владеет исходным буфером, буфер должен жить дольше документа.
+     */
+    class Document {
+    public:
+        explicit Document(std::string_view data);
+
+        const NodeView& Root() const;
+
+        /*
+         * Найти значение по ключу в словаре. Если ключа нет, возвращается nullptr
+         */
+        const NodeView* Find(const NodeView& dict, std::string_view key) const;
+
+        /*
+         * Найти значение по ключу в словаре. Если ключа нет, выбрасывается исключение
+         */
+        const NodeView& Get(const NodeView& dict, std::string_view key) const;
+
+        /*
+         * Вызвать `func` для каждого ребенка списка или словаря
+         */
+        template <class Func>
+        void ForEachChild(const NodeView& node, Func&& func) const {
+            for (size_t i = IndexOf(node) + 1; i < node.end; i = nodes_[i].end) {
+                func(nodes_[i]);
+            }
+        }
+
+        /*
+         * Сколько байт исходного буфера занял разобранный документ
+         */
+        size_t ParsedSize() const;
+
+    private:
+        std::string_view data_;
+        std::vector<NodeView> nodes_;
+
+        size_t ParseNode(size_t& pos, size_t depth);
+        size_t IndexOf(const NodeView& node) const;
+    };
     std::vector<Peer> ParsePeers(const std::string& peers);
-    std::vector<std::string> GetPieceHashes(const std::shared_ptr<NodeDict>& dict);
+
+    /*
+     * Разбить значение info.pieces на хеш-суммы частей файла.
+     * Все хеши лежат в одном непрерывном векторе по 20 байт на часть
+     */
+    std::vector<Sha1Hash> GetPieceHashes(std::string_view pieces);
+
     std::string GetInfoHash(const std::shared_ptr<NodeDict>& dict);
+
+    /*
+     * SHA1 от словаря info, посчитанный прямо по его байтам в исходном буфере.
+     * В отличие от варианта с NodeDict, не требует повторной сериализации и дает правильный хеш
+     * даже для неканонически закодированного словаря
+     */
+    std::string GetInfoHash(const Document& document);
 }
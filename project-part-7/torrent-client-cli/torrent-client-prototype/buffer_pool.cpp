@@ -0,0 +1,32 @@
+#include "buffer_pool.h"
+
+BufferPool::BufferPool(size_t bufferSize, size_t maxFreeBuffers)
+        : bufferSize_(bufferSize)
+        , maxFreeBuffers_(maxFreeBuffers) {
+}
+
+std::unique_ptr<char[]> BufferPool::Acquire() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!freeBuffers_.empty()) {
+            std::unique_ptr<char[]> buffer = std::move(freeBuffers_.back());
+            freeBuffers_.pop_back();
+            return buffer;
+        }
+    }
+    return std::make_unique_for_overwrite<char[]>(bufferSize_);
+}
+
+void BufferPool::Release(std::unique_ptr<char[]> buffer) {
+    if (buffer == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (freeBuffers_.size() < maxFreeBuffers_) {
+        freeBuffers_.push_back(std::move(buffer));
+    }
+}
+
+size_t BufferPool::BufferSize() const {
+    return bufferSize_;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ * Пул буферов одинакового размера. Освобожденные буферы не отдаются аллокатору, а переиспользуются,
+ * но в запасе держится не больше `maxFreeBuffers` штук. Буферы не зануляются.
+ * Методы потокобезопасны
+ */
+class BufferPool {
+public:
+    BufferPool(size_t bufferSize, size_t maxFreeBuffers);
+
+    /*
+     * Взять буфер размера BufferSize() из пула или выделить новый
+     */
+    std::unique_ptr<char[]> Acquire();
+
+    /*
+     * Вернуть буфер в пул
+     */
+    void Release(std::unique_ptr<char[]> buffer);
+
+    size_t BufferSize() const;
+
+private:
+    const size_t bufferSize_;
+    const size_t maxFreeBuffers_;
+    std::vector<std::unique_ptr<char[]>> freeBuffers_;
+    std::mutex mutex_;
+};
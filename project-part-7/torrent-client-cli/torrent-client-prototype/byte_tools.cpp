@@ -1,5 +1,7 @@
 #include "byte_tools.h"
+#include <openssl/evp.h>
 #include <openssl/sha.h>
+#include <stdexcept>
 #include <vector>
 
 int BytesToInt(std::string_view bytes) {
@@ -29,11 +31,68 @@ std::string CalculateSHA1(const std::string& msg) {
     return result;
 }
 
-std::string HexEncode(const std::string& input) {
+Sha1Hash CalculateSHA1Hash(std::string_view data) {
+    Sha1Hash hash;
+    SHA1(reinterpret_cast<const unsigned char*>(data.data()), data.size(), hash.data());
+    return hash;
+}
+
+std::string EncodeBitfield(const std::vector<bool>& pieces) {
+    std::string bitfield((pieces.size() + 7) / 8, '\0');
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        if (pieces[i]) {
+            bitfield[i / 8] |= static_cast<char>(1 << (7 - i % 8));
+        }
+    }
+    return bitfield;
+}
+
+std::vector<bool> DecodeBitfield(std::string_view bitfield) {
+    std::vector<bool> pieces(bitfield.size() * 8);
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        pieces[i] = (static_cast<unsigned char>(bitfield[i / 8]) >> (7 - i % 8)) & 1;
+    }
+    return pieces;
+}
+
+Sha1Hasher::Sha1Hasher()
+        : ctx_(EVP_MD_CTX_new()) {
+    if (ctx_ == nullptr) {
+        throw std::runtime_error("Cannot create SHA1 context!");
+    }
+    Reset();
+}
+
+Sha1Hasher::~Sha1Hasher() {
+    EVP_MD_CTX_free(ctx_);
+}
+
+void Sha1Hasher::Update(std::string_view data) {
+    if (EVP_DigestUpdate(ctx_, data.data(), data.size()) != 1) {
+        throw std::runtime_error("Error in SHA1 update!");
+    }
+}
+
+Sha1Hash Sha1Hasher::Finish() {
+    Sha1Hash hash;
+    if (EVP_DigestFinal_ex(ctx_, hash.data(), nullptr) != 1) {
+        throw std::runtime_error("Error in SHA1 final!");
+    }
+    Reset();
+    return hash;
+}
+
+void Sha1Hasher::Reset() {
+    if (EVP_DigestInit_ex(ctx_, EVP_sha1(), nullptr) != 1) {
+        throw std::runtime_error("Error in SHA1 init!");
+    }
+}
+
+std::string HexEncode(std::string_view input) {
     static const char hex[] = "0123456789ABCDEF";
 
     std::string output;
-    output.resize(input.size() * 2);
+    output.reserve(input.size() * 2);
 
     for (unsigned char c : input) {
         output.push_back(hex[c >> 4]);
@@ -41,4 +100,8 @@ std::string HexEncode(const std::string& input) {
     }
 
     return output;
-}
\ No newline at end of file
+}
+
+std::string HexEncode(const Sha1Hash& input) {
+    return HexEncode(std::string_view(reinterpret_cast<const char*>(input.data()), input.size()));
+}
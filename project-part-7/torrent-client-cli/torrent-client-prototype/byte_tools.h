@@ -1,6 +1,15 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+/*
+ * SHA1 хеш-сумма в бинарном виде: 20 байт, которые хранятся без отдельной аллокации
+ */
+using Sha1Hash = std::array<uint8_t, 20>;
 
 /*
  * Преобразовать 4 байта в формате big endian в int
@@ -9,15 +18,83 @@ int BytesToInt(std::string_view bytes);
 
 std::string IntToBytes(size_t val);
 
+/*
+ * Прочитать 4 байта в формате big endian по указателю. В отличие от BytesToInt, не создает string_view
+ * и не проверяет длину: вызывающий сам убеждается, что 4 байта есть
+ */
+constexpr uint32_t ReadUint32BigEndian(const char* bytes) {
+    return static_cast<uint32_t>(static_cast<uint8_t>(bytes[0])) << 24 |
+           static_cast<uint32_t>(static_cast<uint8_t>(bytes[1])) << 16 |
+           static_cast<uint32_t>(static_cast<uint8_t>(bytes[2])) << 8 |
+           static_cast<uint32_t>(static_cast<uint8_t>(bytes[3]));
+}
+
+/*
+ * Записать `value` в 4 байта по указателю в формате big endian без аллокации, в отличие от IntToBytes.
+ * Возвращает указатель на байт сразу за записанными
+ */
+constexpr char* WriteUint32BigEndian(char* destination, uint32_t value) {
+    destination[0] = static_cast<char>(value >> 24);
+    destination[1] = static_cast<char>(value >> 16);
+    destination[2] = static_cast<char>(value >> 8);
+    destination[3] = static_cast<char>(value);
+    return destination + 4;
+}
+
 /*
  * Расчет SHA1 хеш-суммы. Здесь в результате подразумевается не человеко-читаемая строка, а массив из 20 байтов
  * в том виде, в котором его генерирует библиотека OpenSSL
  */
 std::string CalculateSHA1(const std::string& msg);
 
+/*
+ * То же самое, но без копирования входных данных и без аллокации под результат
+ */
+Sha1Hash CalculateSHA1Hash(std::string_view data);
+
+/*
+ * Упаковать флаги частей файла в битовую маску формата сообщения bitfield: старший бит первого байта -- часть 0
+ */
+std::string EncodeBitfield(const std::vector<bool>& pieces);
+
+/*
+ * Распаковать битовую маску формата сообщения bitfield, флагов получается 8 * bitfield.size()
+ */
+std::vector<bool> DecodeBitfield(std::string_view bitfield);
+
+struct evp_md_ctx_st;
+
+/*
+ * Потоковый расчет SHA1: данные подаются по частям через Update, результат забирается через Finish.
+ * После Finish расчет начинается заново
+ */
+class Sha1Hasher {
+public:
+    Sha1Hasher();
+
+    ~Sha1Hasher();
+
+    Sha1Hasher(const Sha1Hasher&) = delete;
+    Sha1Hasher& operator=(const Sha1Hasher&) = delete;
+
+    void Update(std::string_view data);
+
+    Sha1Hash Finish();
+
+    /*
+     * Забыть все поданные данные и начать расчет заново
+     */
+    void Reset();
+
+private:
+    evp_md_ctx_st* ctx_;
+};
+
 /*
  * Представить массив байтов в виде строки, содержащей только символы, соответствующие цифрам в шестнадцатеричном исчислении.
  * Конкретный формат выходной строки не важен. Важно то, чтобы выходная строка не содержала символов, которые нельзя
  * было бы представить в кодировке utf-8. Данная функция будет использована для вывода SHA1 хеш-суммы в лог.
  */
-std::string HexEncode(const std::string& input);
+std::string HexEncode(std::string_view input);
+
+std::string HexEncode(const Sha1Hash& input);
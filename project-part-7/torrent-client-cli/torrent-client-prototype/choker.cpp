@@ -0,0 +1,94 @@
+#include "choker.h"
+#include <algorithm>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+    constexpr std::chrono::seconds RECHOKE_INTERVAL = 10s;
+    constexpr std::chrono::seconds OPTIMISTIC_UNCHOKE_INTERVAL = 30s;
+}
+
+Choker::Choker(size_t uploadSlots)
+        : uploadSlots_(std::max<size_t>(uploadSlots, 1))
+        , optimistic_(nullptr)
+        , unchokedCount_(0)
+        , lastRechoke_(std::chrono::steady_clock::now())
+        , lastOptimisticUnchoke_(lastRechoke_)
+        , random_(std::random_device{}()) {}
+
+void Choker::UpdatePeer(const PeerConnect* peer, double downloadRate, double uploadRate, bool interested) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    PeerRates& rates = peers_[peer];
+    rates.downloadRate = downloadRate;
+    rates.uploadRate = uploadRate;
+    rates.interested = interested;
+}
+
+void Choker::RemovePeer(const PeerConnect* peer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = peers_.find(peer);
+    if (it == peers_.end()) {
+        return;
+    }
+    unchokedCount_ -= it->second.unchoked;
+    peers_.erase(it);
+    if (optimistic_ == peer) {
+        optimistic_ = nullptr;
+    }
+}
+
+bool Choker::ShouldUnchoke(const PeerConnect* peer, std::chrono::steady_clock::time_point now, bool seeding) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (now - lastRechoke_ >= RECHOKE_INTERVAL) {
+        Rechoke(now, seeding);
+    }
+    auto it = peers_.find(peer);
+    if (it == peers_.end()) {
+        return false;
+    }
+    PeerRates& rates = it->second;
+    if (!rates.interested) {
+        return rates.unchoked;  // незаинтересованному пиру решение ничего не меняет, ждем пересчета
+    }
+    // свободный слот сразу отдаем новому пиру, не дожидаясь пересчета
+    if (!rates.unchoked && unchokedCount_ < uploadSlots_) {
+        rates.unchoked = true;
+        ++unchokedCount_;
+    }
+    return rates.unchoked;
+}
+
+void Choker::Rechoke(std::chrono::steady_clock::time_point now, bool seeding) {
+    lastRechoke_ = now;
+    std::vector<std::pair<double, const PeerConnect*>> candidates;
+    for (auto& [peer, rates] : peers_) {
+        rates.unchoked = false;
+        if (rates.interested) {
+            candidates.emplace_back(seeding ? rates.uploadRate : rates.downloadRate, peer);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), std::greater<>());
+
+    const size_t regularSlots = uploadSlots_ - 1;
+    unchokedCount_ = 0;
+    for (size_t i = 0; i < candidates.size() && i < regularSlots; ++i) {
+        peers_[candidates[i].second].unchoked = true;
+        ++unchokedCount_;
+    }
+
+    bool keepOptimistic = optimistic_ != nullptr && peers_[optimistic_].interested &&
+            now - lastOptimisticUnchoke_ < OPTIMISTIC_UNCHOKE_INTERVAL;
+    if (!keepOptimistic && candidates.size() > regularSlots) {
+        std::uniform_int_distribution<size_t> distribution(regularSlots, candidates.size() - 1);
+        optimistic_ = candidates[distribution(random_)].second;
+        lastOptimisticUnchoke_ = now;
+    }
+    else if (!keepOptimistic) {
+        optimistic_ = nullptr;
+    }
+    if (optimistic_ != nullptr && !peers_[optimistic_].unchoked) {
+        peers_[optimistic_].unchoked = true;
+        ++unchokedCount_;
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+
+class PeerConnect;
+
+/*
+ * Выбор пиров, которым мы отдаем блоки (tit-for-tat).
+ * Раз в 10 секунд заинтересованные в нас пиры ранжируются по скорости, с которой мы у них качаем (а когда качать
+ * больше нечего -- по скорости, с которой они качают у нас), и лучшие `uploadSlots - 1` разблокируются.
+ * Еще один слот раз в 30 секунд отдается случайному заблокированному пиру (optimistic unchoke), чтобы находить
+ * пиров лучше текущих и давать новым пирам первые части. Пока слоты не заняты, новые пиры разблокируются сразу.
+ * Общий для всех потоков цикла событий: соединения сообщают о себе через UpdatePeer и спрашивают решение через
+ * ShouldUnchoke, пересчет выполняет тот поток, который первым спросит после истечения интервала
+ */
+class Choker {
+public:
+    explicit Choker(size_t uploadSlots = 4);
+
+    /*
+     * Сообщить текущие скорости соединения `peer` (байт/с) и хочет ли пир качать у нас
+     */
+    void UpdatePeer(const PeerConnect* peer, double downloadRate, double uploadRate, bool interested);
+
+    /*
+     * Соединение закрыто, его слот освобождается
+     */
+    void RemovePeer(const PeerConnect* peer);
+
+    /*
+     * Должны ли мы сейчас отдавать блоки пиру `peer`. `seeding` -- скачивать больше нечего, и пиры ранжируются
+     * по скорости отдачи
+     */
+    bool ShouldUnchoke(const PeerConnect* peer, std::chrono::steady_clock::time_point now, bool seeding);
+
+private:
+    struct PeerRates {
+        double downloadRate = 0;
+        double uploadRate = 0;
+        bool interested = false;
+        bool unchoked = false;
+    };
+
+    const size_t uploadSlots_;
+    std::mutex mutex_;
+    std::unordered_map<const PeerConnect*, PeerRates> peers_;
+    const PeerConnect* optimistic_;
+    size_t unchokedCount_;
+    std::chrono::steady_clock::time_point lastRechoke_;
+    std::chrono::steady_clock::time_point lastOptimisticUnchoke_;
+    std::mt19937 random_;
+
+    /*
+     * Заново выбрать разблокированных пиров. Вызывается под блокировкой
+     */
+    void Rechoke(std::chrono::steady_clock::time_point now, bool seeding);
+};
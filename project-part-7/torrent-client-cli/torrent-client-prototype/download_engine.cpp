@@ -0,0 +1,247 @@
+#include "download_engine.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+using namespace std::chrono_literals;
+
+namespace {
+    constexpr int MAX_EVENTS = 256;
+    constexpr std::chrono::milliseconds TICK = 100ms;
+    constexpr uint64_t WAKEUP_KEY = std::numeric_limits<uint64_t>::max();
+    constexpr uint64_t LISTENER_KEY = WAKEUP_KEY - 1;
+    constexpr size_t MAX_INBOUND_PEERS = 64;
+}
+
+DownloadEngine::DownloadEngine()
+        : epoll_(epoll_create1(EPOLL_CLOEXEC))
+        , wakeup_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+        , closeNotifier_(-1)
+        , stopped_(false)
+        , listener_(nullptr) {
+    if (epoll_ == -1 || wakeup_ == -1) {
+        throw std::runtime_error("Error in epoll_create1 or eventfd!");
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = WAKEUP_KEY;
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, wakeup_, &event) == -1) {
+        throw std::runtime_error("Error in epoll_ctl!");
+    }
+}
+
+DownloadEngine::~DownloadEngine() {
+    close(wakeup_);
+    close(epoll_);
+}
+
+void DownloadEngine::AddPeer(std::shared_ptr<PeerConnect> peer) {
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        pendingPeers_.push_back(std::move(peer));
+    }
+    uint64_t value = 1;
+    if (write(wakeup_, &value, sizeof(value)) == -1) {
+        std::cerr << "Cannot wake up download engine" << std::endl;
+    }
+}
+
+void DownloadEngine::Listen(PeerListener& listener, AcceptHandler onAccept) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = LISTENER_KEY;
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, listener.GetSocket(), &event) == -1) {
+        throw std::runtime_error("Error in epoll_ctl!");
+    }
+    listener_ = &listener;
+    onAccept_ = std::move(onAccept);
+}
+
+void DownloadEngine::NotifyOnClose(int eventFd) {
+    closeNotifier_ = eventFd;
+}
+
+void DownloadEngine::Run() {
+    epoll_event events[MAX_EVENTS];
+    auto lastTick = std::chrono::steady_clock::now();
+    while (!stopped_.load()) {
+        StartPendingPeers();
+        int ready = epoll_wait(epoll_, events, MAX_EVENTS, TICK.count());
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Error in epoll_wait!");
+        }
+        for (int i = 0; i < ready; ++i) {
+            if (events[i].data.u64 == WAKEUP_KEY) {
+                uint64_t value;
+                while (read(wakeup_, &value, sizeof(value)) > 0) {}
+                continue;
+            }
+            if (events[i].data.u64 == LISTENER_KEY) {
+                AcceptPeers();
+                continue;
+            }
+            size_t index = events[i].data.u64;
+            PeerConnect& peer = *connections_[index].peer;
+            try {
+                peer.OnEvent(events[i].events);
+            } catch (const std::exception& e) {
+                peer.OnError(e);
+            }
+            UpdatePeer(index);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastTick >= TICK) {
+            lastTick = now;
+            for (size_t i = 0; i < connections_.size(); ++i) {
+                if (!connections_[i].registered) {
+                    continue;
+                }
+                try {
+                    connections_[i].peer->OnTimer(now);
+                } catch (const std::exception& e) {
+                    connections_[i].peer->OnError(e);
+                }
+                UpdatePeer(i);
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        pendingPeers_.clear();
+    }
+    for (Connection& connection : connections_) {
+        if (connection.registered) {
+            epoll_ctl(epoll_, EPOLL_CTL_DEL, connection.peer->GetSocket(), nullptr);
+            connection.registered = false;
+        }
+        connection.peer->Terminate();
+    }
+}
+
+void DownloadEngine::Stop() {
+    stopped_.store(true);
+    uint64_t value = 1;
+    if (write(wakeup_, &value, sizeof(value)) == -1) {
+        std::cerr << "Cannot wake up download engine" << std::endl;
+    }
+}
+
+void DownloadEngine::AcceptPeers() {
+    while (true) {
+        std::optional<PeerListener::Connection> accepted;
+        try {
+            accepted = listener_->Accept();
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return;
+        }
+        if (!accepted.has_value()) {
+            return;
+        }
+        size_t inbound = 0;
+        for (const Connection& connection : connections_) {
+            if (connection.registered && connection.peer->Inbound()) {
+                ++inbound;
+            }
+        }
+        std::shared_ptr<PeerConnect> peer;
+        if (inbound < MAX_INBOUND_PEERS) {
+            try {
+                peer = onAccept_(*accepted);
+            } catch (const std::exception& e) {
+                std::cerr << "Cannot accept peer " << accepted->peer.ip << ":" << accepted->peer.port << " -- "
+                          << e.what() << std::endl;
+            }
+        }
+        if (peer == nullptr) {
+            close(accepted->socket);
+            continue;
+        }
+        size_t slot = FreeSlot();
+        connections_[slot].peer = std::move(peer);
+        StartPeer(slot);
+    }
+}
+
+void DownloadEngine::StartPendingPeers() {
+    std::vector<std::shared_ptr<PeerConnect>> peers;
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        peers.swap(pendingPeers_);
+    }
+    for (std::shared_ptr<PeerConnect>& peer : peers) {
+        size_t slot = FreeSlot();
+        connections_[slot].peer = std::move(peer);
+        StartPeer(slot);
+    }
+}
+
+size_t DownloadEngine::FreeSlot() {
+    for (size_t i = 0; i < connections_.size(); ++i) {
+        if (!connections_[i].registered && connections_[i].peer->Terminated()) {
+            return i;
+        }
+    }
+    connections_.push_back({nullptr, false, 0});
+    return connections_.size() - 1;
+}
+
+void DownloadEngine::StartPeer(size_t index) {
+    Connection& connection = connections_[index];
+    try {
+        connection.peer->Start();
+    } catch (const std::exception& e) {
+        connection.peer->OnError(e);
+        NotifyClosed();
+        return;
+    }
+    epoll_event event{};
+    event.events = connection.peer->GetEvents();
+    event.data.u64 = index;
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, connection.peer->GetSocket(), &event) == -1) {
+        connection.peer->OnError(std::runtime_error("Error in epoll_ctl!"));
+        NotifyClosed();
+        return;
+    }
+    connection.registered = true;
+    connection.events = event.events;
+}
+
+void DownloadEngine::UpdatePeer(size_t index) {
+    Connection& connection = connections_[index];
+    if (connection.peer->Terminated()) {
+        // сокет уже закрыт, а закрытый сокет epoll забывает сам
+        connection.registered = false;
+        NotifyClosed();
+        return;
+    }
+    uint32_t events = connection.peer->GetEvents();
+    if (events != connection.events) {
+        epoll_event event{};
+        event.events = events;
+        event.data.u64 = index;
+        if (epoll_ctl(epoll_, EPOLL_CTL_MOD, connection.peer->GetSocket(), &event) == -1) {
+            connection.peer->OnError(std::runtime_error("Error in epoll_ctl!"));
+            connection.registered = false;
+            return;
+        }
+        connection.events = events;
+    }
+}
+
+void DownloadEngine::NotifyClosed() {
+    uint64_t value = 1;
+    if (closeNotifier_ != -1 && write(closeNotifier_, &value, sizeof(value)) == -1) {
+        std::cerr << "Cannot notify about closed connection" << std::endl;
+    }
+}
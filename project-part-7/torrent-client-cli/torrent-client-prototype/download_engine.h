@@ -0,0 +1,110 @@
+#pragma once
+
+#include "peer_connect.h"
+#include "peer_listener.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ * Цикл событий на основе epoll, который обслуживает много соединений с пирами в одном потоке.
+ * Сокеты неблокирующие, каждое соединение (PeerConnect) -- конечный автомат: движок сообщает ему о готовности
+ * сокета и периодически дает проверить таймауты.
+ * Чтобы задействовать несколько ядер, можно запустить несколько движков в разных потоках и распределить
+ * пиров между ними.
+ * Движок сам не переподключается к пирам: завершившееся соединение освобождает свое место, а решать,
+ * подключаться ли к пиру снова, должен тот, кто добавляет пиров (см. PeerManager).
+ */
+class DownloadEngine {
+public:
+    DownloadEngine();
+
+    ~DownloadEngine();
+
+    DownloadEngine(const DownloadEngine&) = delete;
+    DownloadEngine& operator=(const DownloadEngine&) = delete;
+
+    /*
+     * Добавить пира. Подключение к нему начнется в Run. Можно вызывать из любого потока, в том числе во время Run:
+     * пир попадает в очередь, и движок забирает его, проснувшись
+     */
+    void AddPeer(std::shared_ptr<PeerConnect> peer);
+
+    /*
+     * Создает соединение для принятого входящего подключения
+     */
+    using AcceptHandler = std::function<std::shared_ptr<PeerConnect>(const PeerListener::Connection&)>;
+
+    /*
+     * Принимать входящие подключения через `listener` и обслуживать их в этом же цикле событий.
+     * Слушающий сокет не закрывается движком, `listener` должен жить дольше него. Вызывается до Run
+     */
+    void Listen(PeerListener& listener, AcceptHandler onAccept);
+
+    /*
+     * Сообщать о каждом завершившемся соединении записью в eventfd `eventFd`, чтобы тот, кто добавляет пиров,
+     * мог сразу заменить соединение, не опрашивая движок. Вызывается до Run
+     */
+    void NotifyOnClose(int eventFd);
+
+    /*
+     * Крутить цикл событий, пока не вызван Stop. При выходе все соединения закрываются
+     */
+    void Run();
+
+    /*
+     * Остановить цикл событий. Можно вызывать из любого потока
+     */
+    void Stop();
+
+private:
+    struct Connection {
+        std::shared_ptr<PeerConnect> peer;
+        bool registered = false;  // сокет зарегистрирован в epoll
+        uint32_t events = 0;  // события, на которые сокет подписан в epoll (0, пока ограничение скорости не дает ни
+                              // читать, ни отправлять)
+    };
+
+    int epoll_;
+    int wakeup_;  // eventfd, через который Stop будит epoll_wait
+    int closeNotifier_;  // eventfd из NotifyOnClose или -1
+    std::atomic<bool> stopped_;
+    std::vector<Connection> connections_;
+    std::mutex pendingMutex_;
+    std::vector<std::shared_ptr<PeerConnect>> pendingPeers_;  // добавленные через AddPeer, но еще не запущенные
+    PeerListener* listener_;
+    AcceptHandler onAccept_;
+
+    /*
+     * Запустить пиров, добавленных через AddPeer
+     */
+    void StartPendingPeers();
+
+    /*
+     * Место в connections_ для нового соединения: место завершившегося соединения или новое в конце
+     */
+    size_t FreeSlot();
+
+    /*
+     * Начать подключение к пиру и зарегистрировать его сокет в epoll
+     */
+    void StartPeer(size_t index);
+
+    /*
+     * Подписать сокет пира на те события, которых он сейчас ждет.
+     * Если соединение завершилось, его место освобождается
+     */
+    void UpdatePeer(size_t index);
+
+    /*
+     * Принять все ожидающие входящие подключения
+     */
+    void AcceptPeers();
+
+    /*
+     * Соединение завершилось: сообщить об этом через closeNotifier_
+     */
+    void NotifyClosed();
+};
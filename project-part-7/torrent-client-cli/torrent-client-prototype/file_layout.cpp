@@ -0,0 +1,47 @@
+#include "file_layout.h"
+#include "resume_data.h"
+#include <limits>
+
+FileLayout::FileLayout(const TorrentFile& tf)
+        : files_(tf.files)
+        , pieceLength_(tf.pieceLength)
+        , totalLength_(tf.length) {
+    pieceFirstFile_.reserve(tf.pieceHashes.size());
+    size_t fileIndex = 0;
+    for (size_t i = 0; i < tf.pieceHashes.size(); ++i) {
+        size_t pieceOffset = i * pieceLength_;
+        while (fileIndex + 1 < files_.size() && files_[fileIndex].offset + files_[fileIndex].length <= pieceOffset) {
+            ++fileIndex;
+        }
+        pieceFirstFile_.push_back(fileIndex);
+    }
+}
+
+const std::vector<TorrentFileEntry>& FileLayout::Files() const {
+    return files_;
+}
+
+size_t FileLayout::FirstFileAt(size_t offset) const {
+    size_t pieceIndex = offset / pieceLength_;
+    return pieceIndex < pieceFirstFile_.size() ? pieceFirstFile_[pieceIndex] : files_.size();
+}
+
+uint64_t FileLayout::SizeOnDisk(const std::filesystem::path& root) const {
+    uint64_t size = 0;
+    for (const TorrentFileEntry& file : files_) {
+        std::error_code error;
+        uintmax_t fileSize = std::filesystem::file_size(root / file.path, error);
+        if (!error) {
+            size += fileSize;
+        }
+    }
+    return size;
+}
+
+int64_t FileLayout::LatestModificationTime(const std::filesystem::path& root) const {
+    int64_t latest = std::numeric_limits<int64_t>::min();
+    for (const TorrentFileEntry& file : files_) {
+        latest = std::max(latest, FileModificationTime(root / file.path));
+    }
+    return latest;
+}
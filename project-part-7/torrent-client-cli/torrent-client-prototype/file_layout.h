@@ -0,0 +1,77 @@
+#pragma once
+
+#include "torrent_file.h"
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+/*
+ * Приоритет файла торрента, который задает пользователь
+ */
+enum class FilePriority : uint8_t {
+    Skip,  // файл не нужен: его части не скачиваются, если не задевают нужные файлы
+    Normal,
+    High,  // части файла скачиваются раньше частей с приоритетом Normal
+};
+
+/*
+ * Кусок файла торрента, на который приходится часть непрерывного потока байт всех файлов
+ */
+struct FileExtent {
+    size_t fileIndex;  // номер файла в TorrentFile::files
+    size_t fileOffset;  // смещение внутри файла
+    size_t length;
+    size_t dataOffset;  // смещение куска относительно начала запрошенного диапазона
+};
+
+/*
+ * Раскладка частей торрента по файлам. Для каждой части заранее запоминается первый файл, в который она попадает,
+ * поэтому разбиение части на куски файлов стоит столько, сколько файлов она задевает, без поиска по всем файлам
+ */
+class FileLayout {
+public:
+    explicit FileLayout(const TorrentFile& tf);
+
+    const std::vector<TorrentFileEntry>& Files() const;
+
+    /*
+     * Вызвать `func(const FileExtent&)` для каждого куска файла, на который приходится диапазон
+     * [offset, offset + length) потока байт торрента. Куски идут по порядку, файлы нулевой длины пропускаются
+     */
+    template <class Func>
+    void ForEachExtent(size_t offset, size_t length, Func&& func) const {
+        const size_t begin = offset;
+        const size_t end = std::min(offset + length, totalLength_);
+        for (size_t i = FirstFileAt(offset); i < files_.size() && offset < end; ++i) {
+            const TorrentFileEntry& file = files_[i];
+            if (file.offset + file.length <= offset) {
+                continue;
+            }
+            size_t extentLength = std::min(end, file.offset + file.length) - offset;
+            func(FileExtent{i, offset - file.offset, extentLength, offset - begin});
+            offset += extentLength;
+        }
+    }
+
+    /*
+     * Сумма текущих размеров файлов торрента в директории `root`, отсутствующие файлы считаются пустыми
+     */
+    uint64_t SizeOnDisk(const std::filesystem::path& root) const;
+
+    /*
+     * Время изменения самого нового из файлов торрента в директории `root` (см. FileModificationTime)
+     */
+    int64_t LatestModificationTime(const std::filesystem::path& root) const;
+
+private:
+    std::vector<TorrentFileEntry> files_;
+    std::vector<size_t> pieceFirstFile_;  // номер первого файла, в который попадает каждая часть
+    size_t pieceLength_;
+    size_t totalLength_;
+
+    /*
+     * Номер файла, с которого надо начинать поиск куска для смещения `offset`
+     */
+    size_t FirstFileAt(size_t offset) const;
+};
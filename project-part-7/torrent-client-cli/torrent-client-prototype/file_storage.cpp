@@ -0,0 +1,251 @@
+#include "file_storage.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+    /*
+     * Открыть файл торрента на запись, создав недостающие директории, и привести его к длине `length`
+     */
+    int OpenOutputFile(const std::filesystem::path& path, size_t length) {
+        std::error_code error;
+        std::filesystem::create_directories(path.parent_path(), error);
+        if (error) {
+            throw std::runtime_error("Cannot create directory " + path.parent_path().string() + ": " + error.message());
+        }
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open output file " + path.string() + "!");
+        }
+        if (ftruncate(fd, static_cast<off_t>(length)) < 0) {
+            int error = errno;
+            close(fd);
+            throw std::runtime_error("Cannot resize output file " + path.string() + ": " + std::strerror(error));
+        }
+        return fd;
+    }
+
+    void WriteAt(int fd, const char* data, size_t length, size_t offset) {
+        size_t done = 0;
+        while (done < length) {
+            ssize_t written = pwrite(fd, data + done, length - done, static_cast<off_t>(offset + done));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Error while saving piece to disk: " + std::string(std::strerror(errno)));
+            }
+            done += written;
+        }
+    }
+
+    void ReadAt(int fd, char* data, size_t length, size_t offset) {
+        size_t done = 0;
+        while (done < length) {
+            ssize_t bytesRead = pread(fd, data + done, length - done, static_cast<off_t>(offset + done));
+            if (bytesRead < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Error while reading piece from disk: " + std::string(std::strerror(errno)));
+            }
+            if (bytesRead == 0) {
+                throw std::runtime_error("Output file is shorter than expected!");
+            }
+            done += bytesRead;
+        }
+    }
+}
+
+std::unique_ptr<FileStorage> OpenFileStorage(StorageBackend backend, const std::filesystem::path& root,
+                                             const FileLayout& layout, const std::vector<FilePriority>& priorities) {
+    if (backend == StorageBackend::Mmap) {
+        return std::make_unique<MmapFileStorage>(root, layout, priorities);
+    }
+    return std::make_unique<PwriteFileStorage>(root, layout);
+}
+
+PwriteFileStorage::PwriteFileStorage(const std::filesystem::path& root, const FileLayout& layout)
+        : layout_(layout)
+        , open_(true) {
+    try {
+        for (const TorrentFileEntry& file : layout_.Files()) {
+            fds_.push_back(OpenOutputFile(root / file.path, file.length));
+        }
+    } catch (...) {
+        for (int fd : fds_) {
+            close(fd);
+        }
+        throw;
+    }
+}
+
+PwriteFileStorage::~PwriteFileStorage() {
+    if (open_) {
+        for (int fd : fds_) {
+            close(fd);
+        }
+    }
+}
+
+void PwriteFileStorage::Write(size_t offset, std::string_view data) {
+    if (!open_) {
+        throw std::runtime_error("OutputFile is not open!");
+    }
+    layout_.ForEachExtent(offset, data.size(), [&] (const FileExtent& extent) {
+        WriteAt(fds_[extent.fileIndex], data.data() + extent.dataOffset, extent.length, extent.fileOffset);
+    });
+}
+
+void PwriteFileStorage::Read(size_t offset, char* data, size_t length) const {
+    if (!open_) {
+        throw std::runtime_error("OutputFile is not open!");
+    }
+    layout_.ForEachExtent(offset, length, [&] (const FileExtent& extent) {
+        ReadAt(fds_[extent.fileIndex], data + extent.dataOffset, extent.length, extent.fileOffset);
+    });
+}
+
+void PwriteFileStorage::Flush() {
+    if (!open_) {
+        throw std::runtime_error("OutputFile is not open!");
+    }
+    for (int fd : fds_) {
+        if (fdatasync(fd) < 0) {
+            throw std::runtime_error("Error while flushing output file: " + std::string(std::strerror(errno)));
+        }
+    }
+}
+
+void PwriteFileStorage::Close() {
+    if (!open_) {
+        throw std::runtime_error("OutputFile was closed early!");
+    }
+    open_ = false;
+    bool ok = true;
+    for (int fd : fds_) {
+        ok = fsync(fd) == 0 && ok;
+        ok = close(fd) == 0 && ok;
+    }
+    if (!ok) {
+        throw std::runtime_error("Error while saving output file to disk!");
+    }
+}
+
+bool PwriteFileStorage::IsOpen() const {
+    return open_;
+}
+
+MmapFileStorage::MmapFileStorage(const std::filesystem::path& root, const FileLayout& layout,
+                                 const std::vector<FilePriority>& priorities)
+        : layout_(layout)
+        , pageSize_(static_cast<size_t>(sysconf(_SC_PAGESIZE)))
+        , open_(true) {
+    try {
+        for (size_t i = 0; i < layout_.Files().size(); ++i) {
+            const TorrentFileEntry& file = layout_.Files()[i];
+            mappings_.push_back({OpenOutputFile(root / file.path, file.length), nullptr, file.length});
+            Mapping& mapping = mappings_.back();
+            if (mapping.length == 0) {
+                continue;
+            }
+            if (i < priorities.size() && priorities[i] == FilePriority::Skip) {
+                continue;
+            }
+            // ftruncate уже задал размер файла, fallocate дополнительно резервирует под него место на диске
+            if (fallocate(mapping.fd, 0, 0, static_cast<off_t>(mapping.length)) < 0 && errno != EOPNOTSUPP) {
+                throw std::runtime_error("Cannot allocate output file: " + std::string(std::strerror(errno)));
+            }
+            void* data = mmap(nullptr, mapping.length, PROT_READ | PROT_WRITE, MAP_SHARED, mapping.fd, 0);
+            if (data == MAP_FAILED) {
+                throw std::runtime_error("Error in mmap: " + std::string(std::strerror(errno)));
+            }
+            mapping.data = static_cast<char*>(data);
+            // части приходят в случайном порядке, упреждающее чтение соседних страниц бесполезно
+            madvise(mapping.data, mapping.length, MADV_RANDOM);
+        }
+    } catch (...) {
+        Unmap();
+        throw;
+    }
+}
+
+MmapFileStorage::~MmapFileStorage() {
+    if (open_) {
+        Unmap();
+    }
+}
+
+void MmapFileStorage::Unmap() {
+    for (const Mapping& mapping : mappings_) {
+        if (mapping.data != nullptr) {
+            munmap(mapping.data, mapping.length);
+        }
+        close(mapping.fd);
+    }
+    mappings_.clear();
+}
+
+void MmapFileStorage::Write(size_t offset, std::string_view data) {
+    if (!open_) {
+        throw std::runtime_error("OutputFile is not open!");
+    }
+    layout_.ForEachExtent(offset, data.size(), [&] (const FileExtent& extent) {
+        const Mapping& mapping = mappings_[extent.fileIndex];
+        if (mapping.data == nullptr) {
+            WriteAt(mapping.fd, data.data() + extent.dataOffset, extent.length, extent.fileOffset);
+            return;
+        }
+        std::memcpy(mapping.data + extent.fileOffset, data.data() + extent.dataOffset, extent.length);
+        size_t begin = extent.fileOffset / pageSize_ * pageSize_;
+        msync(mapping.data + begin, extent.fileOffset + extent.length - begin, MS_ASYNC);
+    });
+}
+
+void MmapFileStorage::Read(size_t offset, char* data, size_t length) const {
+    if (!open_) {
+        throw std::runtime_error("OutputFile is not open!");
+    }
+    layout_.ForEachExtent(offset, length, [&] (const FileExtent& extent) {
+        const Mapping& mapping = mappings_[extent.fileIndex];
+        if (mapping.data == nullptr) {
+            ReadAt(mapping.fd, data + extent.dataOffset, extent.length, extent.fileOffset);
+            return;
+        }
+        std::memcpy(data + extent.dataOffset, mapping.data + extent.fileOffset, extent.length);
+    });
+}
+
+void MmapFileStorage::Flush() {
+    if (!open_) {
+        throw std::runtime_error("OutputFile is not open!");
+    }
+    for (const Mapping& mapping : mappings_) {
+        int result = mapping.data != nullptr ? msync(mapping.data, mapping.length, MS_SYNC) : fdatasync(mapping.fd);
+        if (result < 0) {
+            throw std::runtime_error("Error while flushing output file: " + std::string(std::strerror(errno)));
+        }
+    }
+}
+
+void MmapFileStorage::Close() {
+    if (!open_) {
+        throw std::runtime_error("OutputFile was closed early!");
+    }
+    open_ = false;
+    bool ok = true;
+    for (const Mapping& mapping : mappings_) {
+        ok = (mapping.data != nullptr ? msync(mapping.data, mapping.length, MS_SYNC) : fsync(mapping.fd)) == 0 && ok;
+    }
+    Unmap();
+    if (!ok) {
+        throw std::runtime_error("Error while saving output file to disk!");
+    }
+}
+
+bool MmapFileStorage::IsOpen() const {
+    return open_;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "file_layout.h"
+#include <filesystem>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/*
+ * Способ записи скачанных частей в выходные файлы
+ */
+enum class StorageBackend {
+    Pwrite,  // pwrite в открытые дескрипторы файлов, запись без блокировок
+    Mmap,  // файлы заранее выделяются на диске и отображаются в память, запись без блокировок
+};
+
+/*
+ * Выходные файлы торрента фиксированной длины, которые видны как один непрерывный поток байт.
+ * В него можно записывать данные по произвольным смещениям, запись на стыке файлов разбивается по FileLayout.
+ * Write можно вызывать из нескольких потоков одновременно для непересекающихся диапазонов
+ */
+class FileStorage {
+public:
+    virtual ~FileStorage() = default;
+
+    /*
+     * Записать `data` в поток байт торрента начиная с позиции `offset`
+     */
+    virtual void Write(size_t offset, std::string_view data) = 0;
+
+    /*
+     * Прочитать `length` байт потока байт торрента начиная с позиции `offset` в `data`.
+     * Можно вызывать из нескольких потоков одновременно, в том числе вместе с Write для других диапазонов
+     */
+    virtual void Read(size_t offset, char* data, size_t length) const = 0;
+
+    /*
+     * Дождаться, пока все записанные данные окажутся на диске, чтобы они пережили и падение процесса,
+     * и падение системы. Вызывается перед сохранением .resume: иначе в нем могли бы оказаться части,
+     * которых на диске еще нет
+     */
+    virtual void Flush() = 0;
+
+    /*
+     * Сбросить все данные на диск и закрыть файлы
+     */
+    virtual void Close() = 0;
+
+    virtual bool IsOpen() const = 0;
+};
+
+/*
+ * Открыть файлы торрента из `layout` в директории `root` с выбранным способом записи и привести их к нужной длине.
+ * Недостающие директории и файлы создаются. Если файлы уже существуют, их данные сохраняются: по ним можно
+ * продолжить прерванное скачивание.
+ * Под файлы с приоритетом Skip место на диске заранее не выделяется: они остаются разреженными, и в них попадают
+ * только байты частей на стыке с нужными файлами. Такие файлы всегда пишутся через pwrite, даже при способе Mmap.
+ * Пустой `priorities` означает, что нужны все файлы
+ */
+std::unique_ptr<FileStorage> OpenFileStorage(StorageBackend backend, const std::filesystem::path& root,
+                                             const FileLayout& layout, const std::vector<FilePriority>& priorities);
+
+/*
+ * Запись через pwrite. Дескрипторы всех файлов открываются заранее, часть записывается одним вызовом
+ * на каждый задетый ею файл
+ */
+class PwriteFileStorage : public FileStorage {
+public:
+    PwriteFileStorage(const std::filesystem::path& root, const FileLayout& layout);
+
+    ~PwriteFileStorage() override;
+
+    void Write(size_t offset, std::string_view data) override;
+
+    void Read(size_t offset, char* data, size_t length) const override;
+
+    void Flush() override;
+
+    void Close() override;
+
+    bool IsOpen() const override;
+
+private:
+    FileLayout layout_;
+    std::vector<int> fds_;
+    bool open_;
+};
+
+/*
+ * Запись через отображение файлов в память. Место под файлы выделяется сразу через fallocate, поэтому запись
+ * в отображение не может упасть из-за нехватки места. Каждая часть копируется сразу на свое место, после чего
+ * для ее страниц запускается асинхронный сброс на диск, чтобы грязные страницы не копились до закрытия файлов.
+ * Пропускаемые файлы не отображаются: место под них не выделено, и запись в разреженную страницу при нехватке
+ * места убила бы процесс сигналом SIGBUS, а pwrite просто вернет ошибку
+ */
+class MmapFileStorage : public FileStorage {
+public:
+    MmapFileStorage(const std::filesystem::path& root, const FileLayout& layout,
+                    const std::vector<FilePriority>& priorities);
+
+    ~MmapFileStorage() override;
+
+    void Write(size_t offset, std::string_view data) override;
+
+    void Read(size_t offset, char* data, size_t length) const override;
+
+    void Flush() override;
+
+    void Close() override;
+
+    bool IsOpen() const override;
+
+private:
+    struct Mapping {
+        int fd;
+        char* data;  // nullptr для файлов нулевой длины и пропускаемых файлов, они пишутся через pwrite
+        size_t length;
+    };
+
+    FileLayout layout_;
+    std::vector<Mapping> mappings_;
+    size_t pageSize_;
+    bool open_;
+
+    void Unmap();
+};
@@ -1,6 +1,13 @@
 #include "torrent_tracker.h"
 #include "piece_storage.h"
+#include "piece_stream.h"
 #include "peer_connect.h"
+#include "download_engine.h"
+#include "peer_manager.h"
+#include "peer_listener.h"
+#include "rate_limiter.h"
+#include "piece_verifier.h"
+#include "file_layout.h"
 #include "byte_tools.h"
 #include <cassert>
 #include <iostream>
@@ -27,19 +34,36 @@ std::string RandomString(size_t length) {
 
 const std::string PeerId = "TESTAPPDONTWORRY" + RandomString(4);
 size_t PiecesToDownload = 20;
-
-void CheckDownloadedPiecesIntegrity(const std::filesystem::path& outputFilename, const TorrentFile& tf, PieceStorage& pieces) {
+const size_t MaxReactorsCount = 4;  // сколько потоков с циклом событий обслуживают пиров
+RequestPipelineSettings PipelineSettings;
+PieceStorageSettings StorageSettings;
+int ListenPort = 12345;  // порт для входящих подключений, о нем сообщаем трекеру
+size_t SeedTime = 0;  // сколько секунд раздавать после окончания скачивания
+const std::chrono::seconds StallTimeout(60);  // сколько ждать, пока все подключенные пиры держат нас заблокированными
+const std::chrono::seconds MinAnnounceInterval(10);  // как часто можно повторно просить пиров у трекера
+PeerManagerSettings ConnectionSettings;  // ограничения на исходящие соединения и паузы между переподключениями
+size_t UploadSlots = 4;  // скольким пирам одновременно отдаем блоки, включая optimistic unchoke
+const size_t MaxRateLimit = 1 << 30;  // КиБ/с
+TokenBucket GlobalDownloadLimit, GlobalUploadLimit;  // общие для всех пиров ограничения скорости
+RateLimits PeerRateLimits{&GlobalDownloadLimit, &GlobalUploadLimit};
+std::vector<size_t> SkippedFiles, HighPriorityFiles;  // номера файлов из параметров --skip-files и --high-files
+fs::path StreamOutput;  // куда писать поток байт торрента по порядку (параметр --stream-to), пусто -- никуда
+const size_t DefaultStreamingWindow = 16;  // окно потокового режима для --stream-to без --streaming-window
+
+void CheckDownloadedPiecesIntegrity(const std::filesystem::path& outputDirectory, const TorrentFile& tf, PieceStorage& pieces) {
     pieces.CloseOutputFile();
 
-    if (std::filesystem::file_size(outputFilename) != tf.length) {
-        throw std::runtime_error("Output file has wrong size");
+    for (const TorrentFileEntry& file : tf.files) {
+        if (std::filesystem::file_size(outputDirectory / file.path) != file.length) {
+            throw std::runtime_error("Output file " + file.path.string() + " has wrong size");
+        }
     }
 
     if (pieces.GetPiecesSavedToDiscIndices().size() != pieces.PiecesSavedToDiscCount()) {
         throw std::runtime_error("Cannot determine real amount of saved pieces");
     }
 
-    if (pieces.PiecesSavedToDiscCount() < PiecesToDownload) {
+    if (pieces.WantedPiecesSavedCount() < PiecesToDownload) {
         throw std::runtime_error("Downloaded pieces amount is not enough");
     }
 
@@ -47,26 +71,14 @@ void CheckDownloadedPiecesIntegrity(const std::filesystem::path& outputFilename,
         throw std::runtime_error("Wrong amount of pieces");
     }
 
-    std::vector<size_t> pieceIndices = pieces.GetPiecesSavedToDiscIndices();
-    std::sort(pieceIndices.begin(), pieceIndices.end());
-
-    std::ifstream file(outputFilename, std::ios_base::binary);
+    const std::vector<size_t>& pieceIndices = pieces.GetPiecesSavedToDiscIndices();
+    std::vector<bool> goodPieces = VerifyPiecesOnDisk(outputDirectory, tf, std::thread::hardware_concurrency(),
+                                                      pieceIndices);
     for (size_t pieceIndex : pieceIndices) {
-        const std::streamoff positionInFile = pieceIndex * tf.pieceLength;
-        file.seekg(positionInFile);
-        if (!file.good()) {
-            throw std::runtime_error("Cannot read from file");
-        }
-        std::string pieceDataFromFile(tf.pieceLength, '\0');
-        file.read(pieceDataFromFile.data(), tf.pieceLength);
-        const size_t readBytesCount = file.gcount();
-        pieceDataFromFile.resize(readBytesCount);
-        const std::string realHash = CalculateSHA1(pieceDataFromFile);
-
-        if (realHash != tf.pieceHashes[pieceIndex]) {
-            std::cerr << "File piece with index " << pieceIndex << " started at position " << positionInFile <<
-                      " with length " << pieceDataFromFile.length() << " has wrong hash " << HexEncode(realHash) <<
-                      ". Expected hash is " << HexEncode(tf.pieceHashes[pieceIndex]) << std::endl;
+        if (!goodPieces[pieceIndex]) {
+            std::cerr << "File piece with index " << pieceIndex << " started at position " <<
+                      pieceIndex * tf.pieceLength << " has wrong hash. Expected hash is " <<
+                      HexEncode(tf.pieceHashes[pieceIndex]) << std::endl;
             throw std::runtime_error("Wrong piece hash");
         }
     }
@@ -83,101 +95,200 @@ void DeleteDownloadedFile(const std::filesystem::path& outputFilename) {
 //    return outputDirectory;
 //}
 
-bool RunDownloadMultithread(PieceStorage& pieces, const TorrentFile& torrentFile, const std::string& ourId, const TorrentTracker& tracker) {
-    using namespace std::chrono_literals;
-
-    std::vector<std::thread> peerThreads;
-    std::vector<std::shared_ptr<PeerConnect>> peerConnections;
-
+/*
+ * Обратиться к трекеру и передать найденных пиров в `peerManager`
+ */
+void AnnounceToTracker(TorrentTracker& tracker, const TorrentFile& torrentFile, const std::string& ourId,
+                       PeerManager& peerManager) {
+    tracker.UpdatePeers(torrentFile, ourId, ListenPort);
+    size_t added = peerManager.AddPeers(tracker.GetPeers());
+
+    std::lock_guard<std::mutex> coutLock(coutMutex);
+    if (tracker.GetPeers().empty()) {
+        std::cerr << "No peers found. Cannot download a file" << std::endl;
+    }
+    std::cout << "Found " << tracker.GetPeers().size() << " peers, " << added << " of them are new" << std::endl;
     for (const Peer& peer : tracker.GetPeers()) {
-        peerConnections.emplace_back(std::make_shared<PeerConnect>(peer, torrentFile, ourId, pieces, peerCount));
-    }
-
-    peerThreads.reserve(peerConnections.size());
-
-    for (auto& peerConnectPtr : peerConnections) {
-        peerThreads.emplace_back(
-                [peerConnectPtr] () {
-                    bool tryAgain = true;
-                    int attempts = 0;
-                    do {
-                        try {
-                            ++attempts;
-                            peerConnectPtr->Run();
-                        } catch (const std::runtime_error& e) {
-                            std::lock_guard<std::mutex> cerrLock(cerrMutex);
-                            std::cerr << "Runtime error: " << e.what() << std::endl;
-                        } catch (const std::exception& e) {
-                            std::lock_guard<std::mutex> cerrLock(cerrMutex);
-                            std::cerr << "Exception: " << e.what() << std::endl;
-                        } catch (...) {
-                            std::lock_guard<std::mutex> cerrLock(cerrMutex);
-                            std::cerr << "Unknown error" << std::endl;
+        std::cout << "Found peer " << peer.ip << ":" << peer.port << std::endl;
+    }
+}
+
+/*
+ * Потоки, в которых работают циклы событий движков. Деструктор останавливает движки и дожидается потоков,
+ * поэтому они завершаются при любом выходе из RunDownloadMultithread, в том числе по исключению
+ * (например, от трекера): деструктор std::thread для еще работающего потока вызвал бы std::terminate
+ */
+class EngineThreads {
+public:
+    explicit EngineThreads(const std::vector<DownloadEngine*>& engines) : engines_(engines) {
+        threads_.reserve(engines_.size());
+        try {
+            for (DownloadEngine* engine : engines_) {
+                threads_.emplace_back(
+                        [engine] () {
+                            try {
+                                engine->Run();
+                            } catch (const std::exception& e) {
+                                std::lock_guard<std::mutex> cerrLock(cerrMutex);
+                                std::cerr << "Exception in download engine: " << e.what() << std::endl;
+                            }
                         }
-                        tryAgain = peerConnectPtr->Failed() && attempts < 3;
-                    } while (tryAgain);
-                }
-        );
+                );
+            }
+        } catch (...) {
+            StopAndJoin();
+            throw;
+        }
     }
 
+    ~EngineThreads() {
+        StopAndJoin();
+    }
+
+    EngineThreads(const EngineThreads&) = delete;
+    EngineThreads& operator=(const EngineThreads&) = delete;
+
+    size_t Count() const {
+        return threads_.size();
+    }
+
+private:
+    const std::vector<DownloadEngine*> engines_;
+    std::vector<std::thread> threads_;
+
+    void StopAndJoin() {
+        for (DownloadEngine* engine : engines_) {
+            engine->Stop();
+        }
+        for (std::thread& thread : threads_) {
+            thread.join();
+        }
+    }
+};
+
+void RunDownloadMultithread(PieceStorage& pieces, const TorrentFile& torrentFile, const std::string& ourId,
+                            TorrentTracker& tracker, PeerListener* listener) {
+    const size_t reactorsCount = std::max<size_t>(1, std::min<size_t>(
+            MaxReactorsCount, std::thread::hardware_concurrency()));
+    Choker choker(UploadSlots);
+    std::vector<std::unique_ptr<DownloadEngine>> engines;
+    std::vector<DownloadEngine*> enginePointers;
+    for (size_t i = 0; i < reactorsCount; ++i) {
+        engines.push_back(std::make_unique<DownloadEngine>());
+        enginePointers.push_back(engines.back().get());
+    }
+    if (listener != nullptr) {
+        engines[0]->Listen(*listener, [&] (const PeerListener::Connection& accepted) {
+            return std::make_shared<PeerConnect>(accepted, torrentFile, ourId, pieces, choker, peerCount,
+                                                 PipelineSettings, PeerRateLimits);
+        });
+    }
+    PeerManager peerManager(enginePointers, [&] (const Peer& peer, int socket) {
+        return std::make_shared<PeerConnect>(peer, socket, torrentFile, ourId, pieces, choker, peerCount,
+                                             PipelineSettings, PeerRateLimits);
+    }, ConnectionSettings);
+
+    EngineThreads engineThreads(enginePointers);
+
     {
         std::lock_guard<std::mutex> coutLock(coutMutex);
-        std::cout << "Started " << peerThreads.size() << " threads for peers" << std::endl;
+        std::cout << "Started " << engineThreads.Count() << " event loop threads" << std::endl;
     }
-    std::this_thread::sleep_for(10s);
-    while (pieces.PiecesSavedToDiscCount() < PiecesToDownload) {
-        if (pieces.PiecesInProgressCount() == 0) {
+    AnnounceToTracker(tracker, torrentFile, ourId, peerManager);
+    auto lastAnnounce = std::chrono::steady_clock::now();
+    peerManager.Update(lastAnnounce);
+    peerManager.WakeOn(pieces.GetEventFd());
+    // соединения переживают обращения к трекеру: заблокировавшие нас пиры остаются подключенными и могут нас
+    // разблокировать, поэтому новых пиров просим, только если живых соединений не осталось или скачивание стоит
+    // слишком долго.
+    // Цикл не опрашивает счетчики по таймеру: его будят сохраненные части, простой всех пиров, закрытые соединения
+    // и подключения (см. PieceStorage::GetEventFd и PeerManager::Wait), а таймаут нужен только для обращения к трекеру
+    bool stalled = false;
+    auto stalledSince = lastAnnounce;
+    while (pieces.WantedPiecesSavedCount() < PiecesToDownload) {
+        auto now = std::chrono::steady_clock::now();
+        if (pieces.PiecesInProgressCount() != 0) {
+            stalled = false;
+            peerManager.Wait(StallTimeout);
+            continue;
+        }
+        if (!stalled) {
+            stalled = true;
+            stalledSince = now;
+        }
+        auto announceAt = lastAnnounce + MinAnnounceInterval;
+        if (peerManager.ConnectionsCount() != 0) {
+            announceAt = std::max(announceAt, stalledSince + StallTimeout);
+        }
+        if (now >= announceAt) {
             {
                 std::lock_guard<std::mutex> coutLock(coutMutex);
                 std::cout
                         << "Want to download more pieces but all peer connections are not working. Let's request new peers"
                         << std::endl;
             }
-
-            for (auto& peerConnectPtr : peerConnections) {
-                peerConnectPtr->Terminate();
-            }
-            for (std::thread& thread : peerThreads) {
-                thread.join();
-            }
-            return true;
+            AnnounceToTracker(tracker, torrentFile, ourId, peerManager);
+            lastAnnounce = std::chrono::steady_clock::now();
+            stalledSince = lastAnnounce;
+            peerManager.Update(lastAnnounce);
+            continue;
         }
-        std::this_thread::sleep_for(1s);
+        peerManager.Wait(std::chrono::ceil<std::chrono::milliseconds>(announceAt - now));
     }
 
+    if (SeedTime > 0) {
+        {
+            std::lock_guard<std::mutex> coutLock(coutMutex);
+            std::cout << "Seeding for " << SeedTime << " seconds" << std::endl;
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(SeedTime));
+    }
     {
         std::lock_guard<std::mutex> coutLock(coutMutex);
         std::cout << "Terminating all peer connections" << std::endl;
     }
-    for (auto& peerConnectPtr : peerConnections) {
-        peerConnectPtr->Terminate();
-    }
-
-    for (std::thread& thread : peerThreads) {
-        thread.join();
-    }
-
-    return false;
 }
 
 void DownloadTorrentFile(const TorrentFile& torrentFile, PieceStorage& pieces, const std::string& ourId) {
     std::cout << "Connecting to tracker " << torrentFile.announce << std::endl;
     TorrentTracker tracker(torrentFile.announce);
-    bool requestMorePeers = false;
-    do {
-        tracker.UpdatePeers(torrentFile, ourId, 12345);
-
-        if (tracker.GetPeers().empty()) {
-            std::cerr << "No peers found. Cannot download a file" << std::endl;
-        }
+    std::unique_ptr<PeerListener> listener;
+    try {
+        listener = std::make_unique<PeerListener>(ListenPort);
+        std::cout << "Listening for incoming peers on port " << ListenPort << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << ", other peers will not be able to connect to us" << std::endl;
+    }
+    RunDownloadMultithread(pieces, torrentFile, ourId, tracker, listener.get());
+}
 
-        std::cout << "Found " << tracker.GetPeers().size() << " peers" << std::endl;
-        for (const Peer& peer : tracker.GetPeers()) {
-            std::cout << "Found peer " << peer.ip << ":" << peer.port << std::endl;
+/*
+ * Собрать приоритеты файлов торрента из параметров --skip-files и --high-files
+ */
+std::vector<FilePriority> MakeFilePriorities(const TorrentFile& torrentFile) {
+    std::vector<FilePriority> priorities(torrentFile.files.size(), FilePriority::Normal);
+    auto setPriority = [&priorities] (const std::vector<size_t>& fileIndices, FilePriority priority) {
+        for (size_t fileIndex : fileIndices) {
+            if (fileIndex >= priorities.size()) {
+                throw std::invalid_argument("Bad file index " + std::to_string(fileIndex) + ", torrent has only " +
+                                            std::to_string(priorities.size()) + " files!");
+            }
+            priorities[fileIndex] = priority;
         }
+    };
+    setPriority(SkippedFiles, FilePriority::Skip);
+    setPriority(HighPriorityFiles, FilePriority::High);
+    return priorities;
+}
 
-        requestMorePeers = RunDownloadMultithread(pieces, torrentFile, ourId, tracker);
-    } while (requestMorePeers);
+/*
+ * Режим --list-files: напечатать номера, размеры и пути файлов торрента для параметров --skip-files и --high-files
+ */
+void ListTorrentFiles(const fs::path& file) {
+    TorrentFile torrentFile = LoadTorrentFile(file);
+    for (size_t i = 0; i < torrentFile.files.size(); ++i) {
+        std::cout << i << "\t" << torrentFile.files[i].length << "\t" << torrentFile.files[i].path.string() << std::endl;
+    }
 }
 
 void TestTorrentFile(const fs::path& file, int percent_to_download, const fs::path& outputDirectory) {
@@ -185,61 +296,244 @@ void TestTorrentFile(const fs::path& file, int percent_to_download, const fs::pa
     TorrentFile torrentFile;
     try {
         torrentFile = LoadTorrentFile(file);
-        PiecesToDownload = ((torrentFile.length / torrentFile.pieceLength) * percent_to_download) / 100;
         std::cout << "Loaded torrent file " << file << ". " << torrentFile.comment << std::endl;
+        StorageSettings.filePriorities = MakeFilePriorities(torrentFile);
     } catch (const std::invalid_argument& e) {
         std::cerr << e.what() << std::endl;
         return;
     }
 
-    PieceStorage pieces(torrentFile, outputDirectory);
+    PieceStorage pieces(torrentFile, outputDirectory, StorageSettings);
+    PiecesToDownload = pieces.WantedPiecesCount() * percent_to_download / 100;
+
+    std::unique_ptr<PieceStream> stream;
+    if (!StreamOutput.empty()) {
+        std::cout << "Streaming torrent data to " << StreamOutput << std::endl;
+        stream = std::make_unique<PieceStream>(pieces, torrentFile, StreamOutput);
+    }
 
     DownloadTorrentFile(torrentFile, pieces, PeerId);
     std::cout << "Downloaded " << pieces.PiecesSavedToDiscCount() << " pieces" << std::endl;
+    if (stream != nullptr) {
+        stream->Finish();
+        std::cout << "Streamed " << stream->BytesWritten() << " of " << torrentFile.length << " bytes" << std::endl;
+    }
 
-    CheckDownloadedPiecesIntegrity(outputDirectory / torrentFile.name, torrentFile, pieces);
+    CheckDownloadedPiecesIntegrity(outputDirectory, torrentFile, pieces);
     std::cout << "Pieces integrity checked" << std::endl;
 //    DeleteDownloadedFile(outputDirectory / torrentFile.name);
 }
 
-int main(int args_count, char* args[]) {
-    if (args_count != 6) {
-        std::cerr << "Bad count of input arguments!" << std::endl;
-        return 1;
+/*
+ * Режим --verify: проверить хеши всех частей уже скачанных файлов во всех ядрах, ничего не скачивая.
+ * Печатает скорость проверки и битовую маску совпавших частей. Возвращает true, если совпали все части
+ */
+bool VerifyTorrentFile(const fs::path& file, const fs::path& outputDirectory) {
+    TorrentFile torrentFile = LoadTorrentFile(file);
+    size_t threadsCount = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "Verifying " << outputDirectory / torrentFile.name << " in " << threadsCount << " threads" << std::endl;
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<bool> goodPieces = VerifyPiecesOnDisk(outputDirectory, torrentFile, threadsCount);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t bytesChecked = std::min<uint64_t>(FileLayout(torrentFile).SizeOnDisk(outputDirectory), torrentFile.length);
+    size_t goodCount = std::count(goodPieces.begin(), goodPieces.end(), true);
+    std::cout << goodCount << " of " << goodPieces.size() << " pieces are good" << std::endl;
+    std::cout << "Checked " << bytesChecked << " bytes in " << seconds << " s, "
+              << (seconds > 0 ? bytesChecked / seconds / 1e9 : 0) << " GB/s" << std::endl;
+    std::cout << "Good pieces bitmap: " << HexEncode(EncodeBitfield(goodPieces)) << std::endl;
+    return goodCount == goodPieces.size();
+}
+
+/*
+ * Разобрать числовое значение параметра командной строки `name` и проверить, что оно лежит в [minValue, maxValue]
+ */
+size_t ParseNumberArgument(const std::string& name, const std::string& value, size_t minValue, size_t maxValue) {
+    size_t result;
+    try {
+        size_t parsed = 0;
+        result = std::stoul(value, &parsed);
+        if (parsed != value.size() || value[0] == '-') {
+            throw std::invalid_argument(value);
+        }
+    }
+    catch (const std::invalid_argument& e) {
+        throw std::invalid_argument("Bad argument " + name + ", it must be a number!");
     }
+    catch (const std::out_of_range& e) {
+        result = maxValue + 1;
+    }
+    if (result < minValue || result > maxValue) {
+        throw std::out_of_range("Bad argument " + name + ", it must be a number between " + std::to_string(minValue) +
+                                " and " + std::to_string(maxValue) + "!");
+    }
+    return result;
+}
+
+/*
+ * Разобрать название способа записи выходных файлов для параметра --storage
+ */
+StorageBackend ParseStorageBackend(const std::string& value) {
+    if (value == "pwrite") {
+        return StorageBackend::Pwrite;
+    }
+    if (value == "mmap") {
+        return StorageBackend::Mmap;
+    }
+    throw std::invalid_argument("Bad argument --storage, it must be pwrite or mmap!");
+}
+
+/*
+ * Разобрать список номеров файлов через запятую для параметров --skip-files и --high-files
+ */
+std::vector<size_t> ParseFileIndices(const std::string& name, const std::string& value) {
+    std::vector<size_t> fileIndices;
+    size_t begin = 0;
+    while (begin <= value.size()) {
+        size_t end = std::min(value.find(',', begin), value.size());
+        fileIndices.push_back(ParseNumberArgument(name, value.substr(begin, end - begin), 0, SIZE_MAX - 1));
+        begin = end + 1;
+    }
+    return fileIndices;
+}
 
-    std::string directory = args[0];
+/*
+ * Разобрать режим продолжения скачивания для параметра --resume
+ */
+ResumeMode ParseResumeMode(const std::string& value) {
+    if (value == "off") {
+        return ResumeMode::Off;
+    }
+    if (value == "trust") {
+        return ResumeMode::Trust;
+    }
+    if (value == "recheck") {
+        return ResumeMode::Recheck;
+    }
+    throw std::invalid_argument("Bad argument --resume, it must be off, trust or recheck!");
+}
+
+int main(int args_count, char* args[]) {
     std::string path_to_save;
-    int percent_to_download;
+    int percent_to_download = 0;
     std::string path_to_torrent;
+    bool verify = false;
+    bool listFiles = false;
 
-    for (int i = 1; i < args_count; ++i) {
-        std::string arg = args[i];
-        if (arg == "-d" && i == 1) {
-            path_to_save = args[++i];
-        }
-        else if (arg == "-p" && i == 3) {
-            try {
-                percent_to_download = std::stoi(args[4]);
-                if (percent_to_download <= 0 || percent_to_download > 100) {
-                    throw std::out_of_range("Bad argument, it must be a number between 1 and 100!");
-                }
+    try {
+        for (int i = 1; i < args_count; ++i) {
+            std::string arg = args[i];
+            if (arg.size() < 2 || arg[0] != '-') {
+                path_to_torrent = arg;
+                continue;
+            }
+            if (arg == "--verify") {
+                verify = true;
+                continue;
+            }
+            if (arg == "--list-files") {
+                listFiles = true;
+                continue;
+            }
+            if (i + 1 >= args_count) {
+                throw std::invalid_argument("Missing value for argument " + arg + "!");
+            }
+            std::string value = args[++i];
+            if (arg == "-d") {
+                path_to_save = value;
+            }
+            else if (arg == "-p") {
+                percent_to_download = static_cast<int>(ParseNumberArgument(arg, value, 1, 100));
+            }
+            else if (arg == "--min-requests") {
+                PipelineSettings.minPendingBlocks = ParseNumberArgument(arg, value, 1, 1024);
+            }
+            else if (arg == "--max-requests") {
+                PipelineSettings.maxPendingBlocks = ParseNumberArgument(arg, value, 1, 1024);
+            }
+            else if (arg == "--storage") {
+                StorageSettings.backend = ParseStorageBackend(value);
             }
-            catch (const std::invalid_argument& e) {
-                std::cerr << "Bad argument, it must be a number!" << std::endl;
-                return 1;
+            else if (arg == "--resume") {
+                StorageSettings.resume = ParseResumeMode(value);
             }
-            catch (const std::out_of_range& e) {
-                std::cerr << e.what() << std::endl;
-                return 1;
+            else if (arg == "--port") {
+                ListenPort = static_cast<int>(ParseNumberArgument(arg, value, 1, 65535));
             }
+            else if (arg == "--seed-time") {
+                SeedTime = ParseNumberArgument(arg, value, 0, 24 * 60 * 60);
+            }
+            else if (arg == "--max-peers") {
+                ConnectionSettings.maxConnections = ParseNumberArgument(arg, value, 1, 1024);
+            }
+            else if (arg == "--upload-slots") {
+                UploadSlots = ParseNumberArgument(arg, value, 1, 256);
+            }
+            else if (arg == "--download-limit") {
+                GlobalDownloadLimit.SetRate(ParseNumberArgument(arg, value, 0, MaxRateLimit) * 1024);
+            }
+            else if (arg == "--upload-limit") {
+                GlobalUploadLimit.SetRate(ParseNumberArgument(arg, value, 0, MaxRateLimit) * 1024);
+            }
+            else if (arg == "--peer-download-limit") {
+                PeerRateLimits.peerDownloadRate = ParseNumberArgument(arg, value, 0, MaxRateLimit) * 1024;
+            }
+            else if (arg == "--peer-upload-limit") {
+                PeerRateLimits.peerUploadRate = ParseNumberArgument(arg, value, 0, MaxRateLimit) * 1024;
+            }
+            else if (arg == "--streaming-window") {
+                StorageSettings.streamingWindow = ParseNumberArgument(arg, value, 1, 1 << 20);
+            }
+            else if (arg == "--stream-to") {
+                StreamOutput = value;
+            }
+            else if (arg == "--skip-files") {
+                SkippedFiles = ParseFileIndices(arg, value);
+            }
+            else if (arg == "--high-files") {
+                HighPriorityFiles = ParseFileIndices(arg, value);
+            }
+            else {
+                throw std::invalid_argument("Unknown argument " + arg + "!");
+            }
+        }
+        if (listFiles && !path_to_torrent.empty()) {
+            ListTorrentFiles(path_to_torrent);
+            return 0;
+        }
+        if (path_to_save.empty() || (percent_to_download == 0 && !verify) || path_to_torrent.empty()) {
+            throw std::invalid_argument("Bad count of input arguments!");
         }
-        else {
-            path_to_torrent = arg;
+        if (PipelineSettings.minPendingBlocks > PipelineSettings.maxPendingBlocks) {
+            throw std::invalid_argument("Bad arguments, --min-requests must not be greater than --max-requests!");
         }
+        if (!StreamOutput.empty() && StorageSettings.streamingWindow == 0) {
+            StorageSettings.streamingWindow = DefaultStreamingWindow;
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
     }
 
-    TestTorrentFile(path_to_torrent, percent_to_download, path_to_save);
+    if (verify) {
+        try {
+            return VerifyTorrentFile(path_to_torrent, path_to_save) ? 0 : 2;
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    try {
+        TestTorrentFile(path_to_torrent, percent_to_download, path_to_save);
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
 
     return 0;
 }
@@ -1,17 +1,82 @@
 #include "message.h"
 #include "byte_tools.h"
+#include <cstring>
+#include <stdexcept>
 
-Message Message::Parse(const std::string &messageString) {
-    return {static_cast<MessageId>(messageString[0]), messageString.length(), messageString.substr(1, messageString.length() - 1)};
+Message Message::Parse(std::string_view message) {
+    if (message.empty()) {
+        throw std::runtime_error("Empty message!");
+    }
+    Message result{static_cast<MessageId>(message[0]), message.substr(1)};
+    size_t size = result.payload.size();
+    switch (result.id) {
+        case MessageId::Have:
+            if (size != 4) {
+                throw std::runtime_error("Wrong have message!");
+            }
+            break;
+        case MessageId::Request:
+        case MessageId::Cancel:
+            if (size != 12) {
+                throw std::runtime_error("Wrong request or cancel message!");
+            }
+            break;
+        case MessageId::Piece:
+            if (size < 8) {
+                throw std::runtime_error("Wrong piece message!");
+            }
+            break;
+        default:
+            break;
+    }
+    return result;
 }
 
-Message Message::Init(MessageId id, const std::string& payload) {
-    return {id, payload.length() + 1, payload};
+Message Message::Init(MessageId id, std::string_view payload) {
+    return {id, payload};
 }
 
-std::string Message::ToString() const {
-    std::string send_message = IntToBytes(messageLength) +
-                               static_cast<char>(id) + payload;
-    return send_message;
+uint32_t Message::PieceIndex() const {
+    return ReadUint32BigEndian(payload.data());
 }
 
+uint32_t Message::BlockOffset() const {
+    return ReadUint32BigEndian(payload.data() + 4);
+}
+
+uint32_t Message::BlockLength() const {
+    return ReadUint32BigEndian(payload.data() + 8);
+}
+
+std::string_view Message::BlockData() const {
+    return payload.substr(8);
+}
+
+size_t Message::EncodedSize() const {
+    return HEADER_SIZE + payload.size();
+}
+
+void Message::Encode(char* destination) const {
+    destination = WriteUint32BigEndian(destination, static_cast<uint32_t>(payload.size() + 1));
+    *destination++ = static_cast<char>(id);
+    std::memcpy(destination, payload.data(), payload.size());
+}
+
+void Message::EncodeBlockMessage(char* destination, MessageId id, uint32_t pieceIndex, uint32_t offset,
+                                 uint32_t length) {
+    if (id != MessageId::Request && id != MessageId::Cancel) {
+        throw std::invalid_argument("Block message must be Request or Cancel");
+    }
+    destination = WriteUint32BigEndian(destination, BLOCK_MESSAGE_SIZE - 4);
+    *destination++ = static_cast<char>(id);
+    destination = WriteUint32BigEndian(destination, pieceIndex);
+    destination = WriteUint32BigEndian(destination, offset);
+    WriteUint32BigEndian(destination, length);
+}
+
+void Message::EncodePieceHeader(char* destination, uint32_t pieceIndex, uint32_t offset, uint32_t length) {
+    destination = WriteUint32BigEndian(destination, PIECE_HEADER_SIZE - 4 + length);
+    *destination++ = static_cast<char>(MessageId::Piece);
+    destination = WriteUint32BigEndian(destination, pieceIndex);
+    WriteUint32BigEndian(destination, offset);
+}
@@ -1,7 +1,8 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
-#include <string>
+#include <string_view>
 
 /*
  * Тип сообщения в протоколе торрента.
@@ -21,27 +22,89 @@ enum class MessageId : uint8_t {
     KeepAlive,
 };
 
+/*
+ * Сообщение протокола без владения данными: payload ссылается на буфер, из которого сообщение разобрано
+ * (например, на входной буфер TcpConnect), или на данные, из которых оно собирается перед отправкой.
+ * Ни разбор, ни кодирование не выделяют память: сообщение пишется прямо в буфер вызывающего
+ */
 struct Message {
+    /*
+     * Длина заголовка "<4 байта длины><id>"
+     */
+    static constexpr size_t HEADER_SIZE = 5;
+
+    /*
+     * Длина сообщения Request или Cancel вместе с 4 байтами длины
+     */
+    static constexpr size_t BLOCK_MESSAGE_SIZE = 17;
+
+    /*
+     * Длина заголовка сообщения Piece "<длина><id><index><begin>", за которым идут данные блока
+     */
+    static constexpr size_t PIECE_HEADER_SIZE = 13;
+
+    /*
+     * Сообщение keep-alive: нулевая длина без id
+     */
+    static constexpr std::string_view KEEP_ALIVE{"\0\0\0\0", 4};
+
     MessageId id;
-    size_t messageLength;
-    std::string payload;
+    std::string_view payload;
 
     /*
-     * Выделяем тип сообщения и длину и создаем объект типа Message.
-     * Подразумевается, что здесь в качестве `messageString` будет приниматься строка, прочитанная из TCP-сокета
+     * Разобрать сообщение без 4 байт длины, как его отдает TcpConnect::ExtractMessage. Для Have, Request, Cancel
+     * и Piece проверяется длина payload, поэтому их поля можно сразу читать через PieceIndex и другие методы.
+     * Сообщение остается валидным, пока жив буфер `message`
      */
-    static Message Parse(const std::string& messageString);
+    static Message Parse(std::string_view message);
 
     /*
-     * Создаем сообщение с заданным типом и содержимым. Длина вычисляется автоматически
+     * Создаем сообщение с заданным типом и содержимым. `payload` не копируется
      */
-    static Message Init(MessageId id, const std::string& payload);
+    static Message Init(MessageId id, std::string_view payload = {});
 
     /*
-     * Формируем строку с сообщением, которую можно будет послать пиру в соответствии с протоколом.
-     * Получается строка вида "<1 + payload length><message id><payload>"
+     * Номер части из сообщений Have, Request, Cancel и Piece
+     */
+    uint32_t PieceIndex() const;
+
+    /*
+     * Смещение блока в части из сообщений Request, Cancel и Piece
+     */
+    uint32_t BlockOffset() const;
+
+    /*
+     * Длина запрошенного блока из сообщений Request и Cancel
+     */
+    uint32_t BlockLength() const;
+
+    /*
+     * Данные блока из сообщения Piece
+     */
+    std::string_view BlockData() const;
+
+    /*
+     * Длина сообщения вместе с 4 байтами длины
+     */
+    size_t EncodedSize() const;
+
+    /*
+     * Записать сообщение "<1 + payload length><message id><payload>" в `destination` (EncodedSize() байт).
      * Секция с длиной сообщения занимает 4 байта и представляет собой целое число в формате big-endian
-     * id сообщения занимает 1 байт и может принимать значения от 0 до 9 включительно
      */
-    std::string ToString() const;
+    void Encode(char* destination) const;
+
+    /*
+     * Записать сообщение о блоке части файла прямо в `destination` (BLOCK_MESSAGE_SIZE байт): Request (запрос
+     * блока) или Cancel (отмена запроса, например, когда в режиме endgame блок уже пришел от другого пира).
+     * У обоих сообщений payload вида "<index><begin><length>", каждое поле занимает 4 байта в формате big-endian
+     */
+    static void EncodeBlockMessage(char* destination, MessageId id, uint32_t pieceIndex, uint32_t offset,
+                                   uint32_t length);
+
+    /*
+     * Записать в `destination` заголовок сообщения Piece (PIECE_HEADER_SIZE байт) для блока длины `length`.
+     * Данные блока вызывающий кладет сразу за заголовком
+     */
+    static void EncodePieceHeader(char* destination, uint32_t pieceIndex, uint32_t offset, uint32_t length);
 };
@@ -1,213 +1,711 @@
 #include "byte_tools.h"
 #include "peer_connect.h"
 #include "message.h"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <sstream>
 #include <utility>
+#include <sys/epoll.h>
+#include <unistd.h>
 
 using namespace std::chrono_literals;
 
-PeerPiecesAvailability::PeerPiecesAvailability()
-{}
+namespace {
+    constexpr std::chrono::milliseconds READ_TIMEOUT = 500ms;
+    // пир молчит, потому что мы ничего не ждем от него (например, он нас заблокировал). По спецификации keep-alive
+    // приходят раз в 2 минуты, поэтому ждем немного дольше
+    constexpr std::chrono::seconds IDLE_TIMEOUT = 150s;
+    constexpr std::chrono::seconds KEEP_ALIVE_INTERVAL = 60s;
+    constexpr size_t HANDSHAKE_LENGTH = 68;
+    constexpr char EXTENDED_MESSAGE_ID = 20;
+    constexpr size_t BLOCK_SIZE = 1 << 14;
+    // мы запрашиваем блоки не длиннее BLOCK_SIZE, поэтому и сообщение Piece (без 4 байт длины) не бывает длиннее
+    constexpr size_t MAX_PIECE_MESSAGE_SIZE = Message::PIECE_HEADER_SIZE - 4 + BLOCK_SIZE;
+    // порция чтения в буфер сокета: несколько сообщений Piece за один recv, остаток последнего блока читается напрямую
+    constexpr size_t ACTIVE_READ_SIZE = 1 << 16;
+    constexpr size_t MAX_RECEIVE_PER_EVENT = 1 << 20;  // чтобы один пир не задерживал остальных в цикле событий
+    constexpr std::chrono::milliseconds RATE_UPDATE_INTERVAL = 500ms;
+    constexpr double SMOOTHING = 0.3;  // вес нового измерения в скользящем среднем
+    constexpr size_t MAX_UPLOAD_REQUESTS = 256;  // сколько запросов пира мы готовы держать в очереди
+    constexpr size_t MAX_QUEUED_UPLOAD_BYTES = 1 << 16;  // сколько данных держать в очереди отправки одному пиру
+}
 
-PeerPiecesAvailability::PeerPiecesAvailability(std::string bitfield)
-        : bitfield_(bitfield)
-{}
+PeerConnect::PeerConnect(const Peer& peer, const TorrentFile &tf, std::string selfPeerId, PieceStorage& pieceStorage,
+                         Choker& choker, std::atomic<int>& peersCount, RequestPipelineSettings pipeline,
+                         const RateLimits& limits)
+        : tf_(tf)
+        , maxMessageSize_(std::max(MAX_PIECE_MESSAGE_SIZE, 1 + (tf.pieceHashes.size() + 7) / 8))
+        , socket_(TcpConnect(peer.ip, peer.port))
+        , inbound_(false)
+        , connectedSocket_(-1)
+        , selfPeerId_(selfPeerId)
+        , piecesAvailability_(PeerPiecesAvailability(tf.pieceHashes.size()))
+        , availabilityRegistered_(false)
+        , terminated_(true)
+        , choked_(true)
+        , amChoking_(true)
+        , choker_(choker)
+        , peerInterested_(false)
+        , announcedPieces_(0)
+        , pieceStorage_(pieceStorage)
+        , pipeline_(pipeline)
+        , pipelineWindow_(pipeline.minPendingBlocks)
+        , downloadRate_(0)
+        , uploadRate_(0)
+        , minResponseTime_(0)
+        , bytesSinceRateUpdate_(0)
+        , bytesUploadedSinceRateUpdate_(0)
+        , failed_(false)
+        , established_(false)
+        , deliveredData_(false)
+        , peersCount_(peersCount)
+        , state_(State::Closed)
+{
+    socket_.SetRateLimits(limits);
+}
 
-bool PeerPiecesAvailability::IsPieceAvailable(size_t pieceIndex) const {
-    return ((bitfield_[pieceIndex / 8] >> (7 - pieceIndex % 8)) & 1);
+PeerConnect::PeerConnect(const PeerListener::Connection& accepted, const TorrentFile& tf, std::string selfPeerId,
+                         PieceStorage& pieceStorage, Choker& choker, std::atomic<int>& peersCount,
+                         RequestPipelineSettings pipeline, const RateLimits& limits)
+        : PeerConnect(accepted.peer, tf, std::move(selfPeerId), pieceStorage, choker, peersCount, pipeline, limits) {
+    inbound_ = true;
+    connectedSocket_ = accepted.socket;
 }
 
-void PeerPiecesAvailability::SetPieceAvailability(size_t pieceIndex) {
-    bitfield_[pieceIndex / 8] |= (1 << (7 - (pieceIndex % 8)));
+PeerConnect::PeerConnect(const Peer& peer, int connectedSocket, const TorrentFile& tf, std::string selfPeerId,
+                         PieceStorage& pieceStorage, Choker& choker, std::atomic<int>& peersCount,
+                         RequestPipelineSettings pipeline, const RateLimits& limits)
+        : PeerConnect(peer, tf, std::move(selfPeerId), pieceStorage, choker, peersCount, pipeline, limits) {
+    connectedSocket_ = connectedSocket;
 }
 
-size_t PeerPiecesAvailability::Size() const {
-    size_t sz = 0;
-    for (auto& ch : bitfield_) {
-        sz += __builtin_popcount((int) ch);
+PeerConnect::~PeerConnect() {
+    if (connectedSocket_ >= 0) {
+        close(connectedSocket_);
     }
-    return sz;
 }
 
-PeerConnect::PeerConnect(const Peer& peer, const TorrentFile &tf, std::string selfPeerId, PieceStorage& pieceStorage, std::atomic<int>& peersCount)
-        : tf_(tf)
-        , socket_(TcpConnect(peer.ip, peer.port, 500ms, 500ms))
-        , selfPeerId_(selfPeerId)
-        , piecesAvailability_(PeerPiecesAvailability())
-        , terminated_(false)
-        , choked_(true)
-        , pieceStorage_(pieceStorage)
-        , pendingBlock_(false)
-        , failed_(false)
-        , peersCount_(peersCount) {
-            peersCount_.fetch_add(1);
+void PeerConnect::Start() {
+    piecesAvailability_ = PeerPiecesAvailability(tf_.pieceHashes.size());
+    choked_ = true;
+    amChoking_ = true;
+    peerInterested_ = false;
+    announcedPieces_ = 0;
+    pipelineWindow_ = pipeline_.minPendingBlocks;
+    downloadRate_ = 0;
+    uploadRate_ = 0;
+    minResponseTime_ = 0;
+    bytesSinceRateUpdate_ = 0;
+    bytesUploadedSinceRateUpdate_ = 0;
+    failed_ = false;
+    established_ = false;
+    deliveredData_ = false;
+    terminated_ = false;
+    peersCount_.fetch_add(1);
+    lastActivity_ = std::chrono::steady_clock::now();
+    lastRateUpdate_ = lastActivity_;
+    lastKeepAlive_ = lastActivity_;
+    if (connectedSocket_ < 0) {
+        throw std::runtime_error("Cannot reconnect to peer!");
+    }
+    state_ = State::Handshake;
+    socket_.AcceptConnection(std::exchange(connectedSocket_, -1));
+    if (!inbound_) {
+        PerformHandshake();
+    }
+}
+
+void PeerConnect::OnEvent(uint32_t events) {
+    if (terminated_.load()) {
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        bool open = (state_ == State::Active ? ReceiveMessages() : socket_.ReceiveAvailable());
+        lastActivity_ = std::chrono::steady_clock::now();
+        if (state_ != State::Handshake || ReceiveHandshake()) {
+            ProcessMessages();
+        }
+        if (!open && !terminated_.load()) {
+            throw std::runtime_error("Connection closed!");
         }
+    }
 
-void PeerConnect::Run() {
-    while (!terminated_.load()) {
-        if (EstablishConnection()) {
-            MainLoop();
-        } else {
-            failed_.store(true);
-            std::cerr << "Cannot establish connection to peer" << std::endl;
+    if (state_ == State::Active && !terminated_.load()) {
+        if (pieceStorage_.EndgameStarted()) {
+            CancelReceivedBlocks();
+        }
+        if (!choked_) {
+            RequestPieces();
+        }
+        // входящий пир пришел качать у нас, даже если сам еще не успел сказать Interested
+        if (!inbound_ && pieceStorage_.QueueIsEmpty() && piecesInProgress_.empty() && !peerInterested_) {
             Terminate();
+            return;
         }
     }
+    if (!terminated_.load()) {
+        SendQueuedData();
+    }
 }
 
-bool PeerConnect::EstablishConnection() {
-    try {
-        PerformHandshake();
-        ReceiveBitfield();
-        SendInterested();
-        return true;
-    } catch (const std::exception& e) {
+void PeerConnect::OnTimer(std::chrono::steady_clock::time_point now) {
+    if (terminated_.load()) {
+        return;
+    }
+    if (socket_.ReceiveLimited()) {
+        lastActivity_ = now;  // данные пира, возможно, ждут в сокете, пока мы не читаем их из-за ограничения скорости
+    }
+    if (state_ != State::Active && socket_.SendLimited()) {
+        lastActivity_ = now;  // пир не может ответить на handshake или bitfield, который мы еще не отправили
+    }
+    if (state_ == State::Active && pendingRequests_.empty()) {
+        // мы ничего не ждем от пира, поэтому его молчание -- не ошибка, пока он не пропустил keep-alive
+        if (now - lastActivity_ > IDLE_TIMEOUT) {
+            throw std::runtime_error("Peer is idle for too long!");
+        }
+    }
+    else if (now - lastActivity_ > READ_TIMEOUT) {
+        throw std::runtime_error("Descriptor isn't ready!");
+    }
+    if (state_ == State::Active && now - lastRateUpdate_ >= RATE_UPDATE_INTERVAL) {
+        UpdatePipelineWindow(now);
+    }
+    if (state_ == State::Active) {
+        UpdateChoking(now);
+    }
+    if (state_ == State::Active && now - lastKeepAlive_ >= KEEP_ALIVE_INTERVAL) {
+        socket_.QueueData(Message::KEEP_ALIVE);
+        lastKeepAlive_ = now;
+    }
+    if (state_ == State::Active && pieceStorage_.EndgameStarted()) {
+        CancelReceivedBlocks();
+    }
+    // новые части могли появиться, пока PieceStorage придерживал их из-за очереди на проверку
+    if (state_ == State::Active && !choked_) {
+        RequestPieces();
+    }
+    if (state_ == State::Active) {
+        AnnounceNewPieces();
+    }
+    // при ограничении скорости EPOLLOUT не ждем (см. GetEvents), поэтому очередь дописывается здесь во всех состояниях
+    SendQueuedData();
+}
+
+void PeerConnect::OnError(const std::exception& error) {
+    if (state_ != State::Active) {
+        failed_.store(!inbound_);
         std::cerr << "Failed to establish connection with peer " << socket_.GetIp() << ":" <<
-                  socket_.GetPort() << " -- " << e.what() << std::endl;
-        return false;
+                  socket_.GetPort() << " -- " << error.what() << std::endl;
+    }
+    else {
+        std::cerr << "Runtime error with peer " << socket_.GetIp() << ":" <<
+                  socket_.GetPort() << " -- " << error.what() << std::endl;
     }
+    Terminate();
+}
+
+uint32_t PeerConnect::GetEvents() {
+    uint32_t events = 0;
+    if (socket_.CanReceive()) {
+        events |= EPOLLIN;
+    }
+    if (socket_.HasDataToSend() && socket_.CanSend()) {
+        events |= EPOLLOUT;
+    }
+    return events;
+}
+
+int PeerConnect::GetSocket() const {
+    return socket_.GetSocket();
 }
 
 void PeerConnect::PerformHandshake() {
-    if (!terminated_.load()) {
-        socket_.EstablishConnection();
-        std::string handshake = "BitTorrent protocol00000000" + tf_.infoHash + selfPeerId_;
-        handshake = ((char) 19) + handshake;
-        socket_.SendData(handshake);
-        std::string peer_handshake = socket_.ReceiveData(68);
-        if (peer_handshake[0] != ((char) 19) ||
-            peer_handshake.substr(1, 19) != "BitTorrent protocol") {
-            throw std::runtime_error("Bad peer_handshake!");
+    SendHandshake();
+    state_ = State::Handshake;
+}
+
+void PeerConnect::SendHandshake() {
+    std::string handshake = "BitTorrent protocol00000000" + tf_.infoHash + selfPeerId_;
+    handshake = ((char) 19) + handshake;
+    socket_.QueueData(handshake);
+}
+
+bool PeerConnect::ReceiveHandshake() {
+    std::string peer_handshake;
+    if (!socket_.ExtractData(HANDSHAKE_LENGTH, peer_handshake)) {
+        return false;
+    }
+    if (peer_handshake[0] != ((char) 19) ||
+        peer_handshake.substr(1, 19) != "BitTorrent protocol") {
+        throw std::runtime_error("Bad peer_handshake!");
+    }
+    if (peer_handshake.substr(28, 20) != tf_.infoHash) {
+        throw std::runtime_error("Bad peer_handshake in infoHash!");
+    }
+    peerId_ = peer_handshake.substr(48, 20);
+    if (inbound_) {
+        SendHandshake();
+    }
+    SendBitfield();
+    state_ = State::Bitfield;
+    return true;
+}
+
+void PeerConnect::SendBitfield() {
+    auto [bitfield, savedPieces] = pieceStorage_.GetBitfield();
+    announcedPieces_ = savedPieces;
+    if (savedPieces > 0) {
+        SendMessage(Message::Init(MessageId::BitField, bitfield));
+    }
+}
+
+void PeerConnect::AnnounceNewPieces() {
+    std::vector<size_t> pieces;
+    announcedPieces_ = pieceStorage_.GetPiecesSavedSince(announcedPieces_, pieces);
+    for (size_t pieceIndex : pieces) {
+        // пиру, у которого часть уже есть, Have ничего не дает
+        if (!piecesAvailability_.IsPieceAvailable(pieceIndex)) {
+            char payload[4];
+            WriteUint32BigEndian(payload, pieceIndex);
+            SendMessage(Message::Init(MessageId::Have, std::string_view(payload, sizeof(payload))));
+        }
+    }
+}
+
+void PeerConnect::ProcessMessages() {
+    std::string_view message;
+    while (!terminated_.load() && !incomingBlock_.has_value()) {
+        if (state_ == State::Active && ReceivePieceMessage()) {
+            continue;
         }
-        if (peer_handshake.substr(28, 20) != tf_.infoHash) {
-            throw std::runtime_error("Bad peer_handshake in infoHash!");
+        if (!socket_.ExtractMessage(message, maxMessageSize_)) {
+            break;
+        }
+        if (message.empty()) {
+            continue;  // keep-alive
+        }
+        if (state_ == State::Bitfield) {
+            ReceiveBitfield(message);
+        }
+        else {
+            HandleMessage(message);
         }
     }
-    else {
-        throw std::runtime_error("Peer was terminated!");
+}
+
+void PeerConnect::ReceiveBitfield(std::string_view message) {
+    if (message[0] == EXTENDED_MESSAGE_ID) {
+        return;
+    }
+    MessageId id = static_cast<MessageId>((int) message[0]);
+    if (id == MessageId::BitField) {
+        piecesAvailability_ = ParseBitfield(message.substr(1));
+    }
+    pieceStorage_.AddPeer(piecesAvailability_);
+    availabilityRegistered_ = true;
+    SendInterested();
+    state_ = State::Active;
+    established_.store(true);
+    if (id != MessageId::BitField) {
+        HandleMessage(message);
     }
 }
 
-void PeerConnect::ReceiveBitfield() {
-    if (!terminated_.load()) {
-        std::string receive_data = socket_.ReceiveData(0);
-        if (receive_data[0] == (char) 20) {
-            receive_data = socket_.ReceiveData(0);
+PeerPiecesAvailability PeerConnect::ParseBitfield(std::string_view bitfield) const {
+    if (bitfield.size() != (tf_.pieceHashes.size() + 7) / 8) {
+        throw std::runtime_error("Wrong bitfield length!");
+    }
+    return PeerPiecesAvailability(std::string(bitfield));
+}
+
+void PeerConnect::SendInterested() {
+    SendMessage(Message::Init(MessageId::Interested));
+}
+
+void PeerConnect::SendMessage(const Message& message) {
+    message.Encode(socket_.ReserveDataToSend(message.EncodedSize()));
+}
+
+void PeerConnect::RequestPieces() {
+    if (pendingRequests_.empty()) {
+        lastActivity_ = std::chrono::steady_clock::now();  // ответа на первый запрос ждем с момента его отправки
+    }
+    while (pendingRequests_.size() < pipelineWindow_) {
+        auto [piece, block] = NextBlockToRequest();
+        if (block == nullptr) {
+            return;
         }
-        MessageId id = static_cast<MessageId>((int) receive_data[0]);
-        if (id == MessageId::BitField) {
-            piecesAvailability_ = PeerPiecesAvailability(receive_data.substr(1, receive_data.size() - 1));
+        Message::EncodeBlockMessage(socket_.ReserveDataToSend(Message::BLOCK_MESSAGE_SIZE), MessageId::Request,
+                                    piece->GetIndex(), block->offset, block->length);
+        pendingRequests_.push_back({piece, block->offset, std::chrono::steady_clock::now()});
+    }
+}
+
+std::pair<PiecePtr, Block*> PeerConnect::NextBlockToRequest() {
+    for (const PiecePtr& piece : piecesInProgress_) {
+        if (Block* block = piece->RequestMissingBlock()) {
+            return {piece, block};
         }
-        else if (id == MessageId::Unchoke) {
-            choked_ = false;
+    }
+
+    while (PiecePtr next_piece = pieceStorage_.GetNextPieceToDownload(piecesAvailability_)) {
+        piecesInProgress_.push_back(next_piece);
+        if (Block* block = next_piece->RequestMissingBlock()) {
+            return {next_piece, block};
+        }
+    }
+
+    // endgame: запрашиваем блоки, которые уже запрошены у других пиров
+    if (!pieceStorage_.IsEndgame()) {
+        return {nullptr, nullptr};
+    }
+    for (const PiecePtr& piece : piecesInProgress_) {
+        if (Block* block = piece->RequestPendingBlock(RequestedOffsets(piece))) {
+            return {piece, block};
+        }
+    }
+    while (PiecePtr next_piece = pieceStorage_.GetEndgamePiece(piecesAvailability_, piecesInProgress_)) {
+        piecesInProgress_.push_back(next_piece);
+        if (Block* block = next_piece->RequestMissingBlock()) {
+            return {next_piece, block};
+        }
+        if (Block* block = next_piece->RequestPendingBlock({})) {
+            return {next_piece, block};
+        }
+    }
+    return {nullptr, nullptr};
+}
+
+std::vector<uint32_t> PeerConnect::RequestedOffsets(const PiecePtr& piece) const {
+    std::vector<uint32_t> offsets;
+    for (const PendingRequest& request : pendingRequests_) {
+        if (request.piece == piece) {
+            offsets.push_back(request.offset);
+        }
+    }
+    return offsets;
+}
+
+void PeerConnect::CancelReceivedBlocks() {
+    for (auto request = pendingRequests_.begin(); request != pendingRequests_.end();) {
+        if (request->piece->IsBlockRetrieved(request->offset)) {
+            size_t length = std::min<size_t>(BLOCK_SIZE, request->piece->GetLength() - request->offset);
+            Message::EncodeBlockMessage(socket_.ReserveDataToSend(Message::BLOCK_MESSAGE_SIZE), MessageId::Cancel,
+                                        request->piece->GetIndex(), request->offset, length);
+            request = pendingRequests_.erase(request);
         }
         else {
-            throw std::runtime_error("Wrong bitfield!");
+            ++request;
         }
     }
-    else {
-        throw std::runtime_error("Peer was terminated!");
+    for (auto piece = piecesInProgress_.begin(); piece != piecesInProgress_.end();) {
+        if ((*piece)->AllBlocksRetrieved()) {
+            pieceStorage_.ReleasePiece(*piece);
+            piece = piecesInProgress_.erase(piece);
+        }
+        else {
+            ++piece;
+        }
     }
 }
 
-void PeerConnect::SendInterested() {
-    if (!terminated_.load()) {
-        std::string interested = IntToBytes(1) + static_cast<char>(MessageId::Interested);
-        socket_.SendData(interested);
+void PeerConnect::HandleMessage(std::string_view rawMessage) {
+    Message message = Message::Parse(rawMessage);
+    MessageId id = message.id;
+    if (id == MessageId::Have) {
+        size_t piece_index = message.PieceIndex();
+        if (piece_index >= tf_.pieceHashes.size()) {
+            throw std::runtime_error("Wrong piece index in Have message!");
+        }
+        if (!piecesAvailability_.IsPieceAvailable(piece_index)) {
+            piecesAvailability_.SetPieceAvailability(piece_index);
+            pieceStorage_.PeerHasPiece(piece_index);
+        }
+    }
+    else if (id == MessageId::BitField) {
+        PeerPiecesAvailability availability = ParseBitfield(message.payload);
+        pieceStorage_.RemovePeer(piecesAvailability_);
+        piecesAvailability_ = std::move(availability);
+        pieceStorage_.AddPeer(piecesAvailability_);
+    }
+    else if (id == MessageId::Piece) {
+        ReceiveBlock(message.PieceIndex(), message.BlockOffset(), message.BlockData());
+    }
+    else if (id == MessageId::Choke) {
+        ReceiveChoke();
+    }
+    else if (id == MessageId::Unchoke) {
+        choked_ = false;
+    }
+    else if (id == MessageId::Interested) {
+        peerInterested_ = true;
+        choker_.UpdatePeer(this, downloadRate_, uploadRate_, peerInterested_);
+        UpdateChoking(std::chrono::steady_clock::now());  // свободный слот отдается сразу
+    }
+    else if (id == MessageId::NotInterested) {
+        peerInterested_ = false;
+        choker_.UpdatePeer(this, downloadRate_, uploadRate_, peerInterested_);
+    }
+    else if (id == MessageId::Request) {
+        ReceiveRequest(message);
+    }
+    else if (id == MessageId::Cancel) {
+        ReceiveCancel(message);
+    }
+    else if (id == MessageId::Port || rawMessage[0] == EXTENDED_MESSAGE_ID) {
+        return;  // DHT и расширения протокола не поддерживаем
     }
     else {
-        throw std::runtime_error("Peer was terminated!");
+        throw std::runtime_error("WRONG MessageId!");
     }
 }
 
-void PeerConnect::RequestPiece() {
-    if (!terminated_.load()) {
-        if (pieceInProgress_ == nullptr) {
-            PiecePtr next_piece = pieceStorage_.GetNextPieceToDownload();
-            while ((next_piece == nullptr ? false : true) &&
-                   !piecesAvailability_.IsPieceAvailable(next_piece->GetIndex())) {
-                pieceStorage_.AddPiece(next_piece);
-                next_piece = pieceStorage_.GetNextPieceToDownload();
+void PeerConnect::ReceiveRequest(const Message& message) {
+    UploadRequest request{message.PieceIndex(), message.BlockOffset(), message.BlockLength()};
+    if (request.length == 0 || request.length > BLOCK_SIZE) {
+        throw std::runtime_error("Wrong requested block length!");
+    }
+    if (amChoking_ || uploadRequests_.size() >= MAX_UPLOAD_REQUESTS || !pieceStorage_.HasPiece(request.piece)) {
+        return;
+    }
+    uploadRequests_.push_back(request);
+}
 
+void PeerConnect::ReceiveCancel(const Message& message) {
+    uint32_t pieceIndex = message.PieceIndex();
+    uint32_t offset = message.BlockOffset();
+    auto request = std::find_if(uploadRequests_.begin(), uploadRequests_.end(),
+                                [pieceIndex, offset] (const UploadRequest& request) {
+        return request.piece == pieceIndex && request.offset == offset;
+    });
+    if (request != uploadRequests_.end()) {
+        uploadRequests_.erase(request);
+    }
+}
+
+void PeerConnect::ServeUploadRequests() {
+    while (!uploadRequests_.empty() && socket_.DataToSendSize() < MAX_QUEUED_UPLOAD_BYTES) {
+        UploadRequest request = uploadRequests_.front();
+        uploadRequests_.pop_front();
+        char* message = socket_.ReserveDataToSend(Message::PIECE_HEADER_SIZE + request.length);
+        Message::EncodePieceHeader(message, request.piece, request.offset, request.length);
+        pieceStorage_.ReadBlock(request.piece, request.offset, request.length, message + Message::PIECE_HEADER_SIZE);
+        bytesUploadedSinceRateUpdate_ += request.length;
+    }
+}
+
+void PeerConnect::SendQueuedData() {
+    if (state_ == State::Active) {
+        ServeUploadRequests();
+    }
+    // пока сокет принимает все, дочитываем с диска следующие блоки по запросам пира
+    while (socket_.FlushData(!uploadRequests_.empty()) && !uploadRequests_.empty()) {
+        ServeUploadRequests();
+    }
+}
+
+void PeerConnect::UpdateChoking(std::chrono::steady_clock::time_point now) {
+    bool unchoke = choker_.ShouldUnchoke(this, now, pieceStorage_.AllWantedPiecesSaved());
+    if (unchoke == !amChoking_) {
+        return;
+    }
+    amChoking_ = !unchoke;
+    if (amChoking_) {
+        uploadRequests_.clear();  // после choke пир знает, что ответов на его запросы не будет
+    }
+    SendMessage(Message::Init(amChoking_ ? MessageId::Choke : MessageId::Unchoke));
+}
+
+void PeerConnect::ReceiveChoke() {
+    choked_ = true;
+    ReleasePiecesInProgress();
+}
+
+bool PeerConnect::ReceiveMessages() {
+    size_t received = 0;
+    while (!terminated_.load() && received < MAX_RECEIVE_PER_EVENT) {
+        if (incomingBlock_.has_value()) {
+            size_t remaining = incomingBlock_->length - incomingBlock_->received;
+            bool open = ReceiveIncomingBlock();
+            if (!open || incomingBlock_.has_value()) {
+                return open;  // сокет опустел посреди блока
             }
-            if (next_piece != nullptr) {
-                pieceInProgress_ = next_piece;
-            }
-            else {
-                return;
-            }
+            received += remaining;
         }
-        if (!pendingBlock_.load()) {
-            Block* cur_block = pieceInProgress_->FirstMissingBlock();
-            if (cur_block == nullptr) {
-                pieceInProgress_ = nullptr;
-                pendingBlock_.store(false);
-                RequestPiece();
-            }
-            else {
-                pendingBlock_.store(true);
-                cur_block->status = Block::Status::Pending;
-                std::string request = IntToBytes(13) + static_cast<char>(MessageId::Request) +
-                                      IntToBytes(pieceInProgress_->GetIndex()) +
-                                      IntToBytes((*cur_block).offset) + IntToBytes((*cur_block).length);
-                socket_.SendData(request);
-            }
+        size_t buffered = socket_.BufferedData().size();
+        bool open = socket_.ReceiveAvailable(ACTIVE_READ_SIZE);
+        size_t newData = socket_.BufferedData().size() - buffered;
+        received += newData;
+        ProcessMessages();
+        if (!open || newData < ACTIVE_READ_SIZE) {
+            return open;  // сокет опустел, следующий recv вернул бы EAGAIN
         }
     }
+    return true;
+}
+
+bool PeerConnect::ReceivePieceMessage() {
+    std::string_view buffered = socket_.BufferedData();
+    if (buffered.size() < Message::PIECE_HEADER_SIZE || buffered[4] != static_cast<char>(MessageId::Piece)) {
+        return false;
+    }
+    size_t size = ReadUint32BigEndian(buffered.data());
+    if (size < Message::PIECE_HEADER_SIZE - 4 || size > MAX_PIECE_MESSAGE_SIZE) {
+        throw std::runtime_error("Wrong piece message!");
+    }
+    size_t pieceIndex = ReadUint32BigEndian(buffered.data() + 5);
+    size_t offset = ReadUint32BigEndian(buffered.data() + 9);
+    size_t length = size - (Message::PIECE_HEADER_SIZE - 4);
+    std::string_view payload = buffered.substr(Message::PIECE_HEADER_SIZE, length);
+
+    if (buffered.size() >= 4 + size) {
+        ReceiveBlock(pieceIndex, offset, payload);
+        socket_.ConsumeData(4 + size);
+        return true;
+    }
+
+    // блок пришел не целиком: уже пришедшие данные копируем в буфер части, а остальное будем читать туда из сокета
+    auto request = FindPendingRequest(pieceIndex, offset);
+    if (request == pendingRequests_.end()) {
+        return false;
+    }
+    char* destination = request->piece->BeginBlockWrite(offset, length);
+    if (destination == nullptr) {
+        return false;
+    }
+    std::copy(payload.begin(), payload.end(), destination);
+    incomingBlock_ = IncomingBlock{request->piece, static_cast<uint32_t>(offset), destination, length, payload.size()};
+    socket_.ConsumeData(buffered.size());
+    return true;
+}
+
+bool PeerConnect::ReceiveIncomingBlock() {
+    IncomingBlock& block = *incomingBlock_;
+    size_t received = 0;
+    bool open = socket_.ReceiveInto(block.data + block.received, block.length - block.received, received);
+    block.received += received;
+    if (block.received < block.length) {
+        return open;
+    }
+
+    PiecePtr piece = block.piece;
+    size_t offset = block.offset;
+    size_t length = block.length;
+    incomingBlock_.reset();
+    piece->FinishBlockWrite(offset);
+    auto request = FindPendingRequest(piece->GetIndex(), offset);
+    if (request != pendingRequests_.end()) {
+        CompleteRequest(request, length);
+    }
+    BlockRetrieved(piece);
+    return open;
+}
+
+void PeerConnect::ReceiveBlock(size_t pieceIndex, size_t offset, std::string_view data) {
+    auto request = FindPendingRequest(pieceIndex, offset);
+    if (request == pendingRequests_.end()) {
+        return;
+    }
+    PiecePtr piece = request->piece;
+    CompleteRequest(request, data.size());
+    if (piece->SaveBlock(offset, data)) {
+        BlockRetrieved(piece);
+    }
     else {
-        throw std::runtime_error("Peer was terminated!");
+        piece->CancelBlock(offset);  // блок прямо сейчас записывает другой пир, а мы его больше не ждем
     }
 }
 
-void PeerConnect::MainLoop() {
-    while (!terminated_.load()) {
-        if (pieceStorage_.QueueIsEmpty()) {
-            Terminate();
-            continue;
-        }
-        std::string receive_data = socket_.ReceiveData(0);
-        if (!receive_data.empty()) {
-            MessageId id = static_cast<MessageId>((int) receive_data[0]);
-            std::string data = receive_data.substr(1, receive_data.size() - 1);
-            if (id == MessageId::Have) {
-                size_t piece_index = BytesToInt(data.substr(4, 4));
-                piecesAvailability_.SetPieceAvailability(piece_index);
-            }
-            else if (id == MessageId::Piece) {
-                size_t piece_index = BytesToInt(data.substr(0, 4));
-                size_t offset = BytesToInt(data.substr(4, 4));
-                std::string blocks = data.substr(8, data.size() - 8);
-                if (pieceInProgress_ != nullptr && pieceInProgress_->GetIndex() == piece_index) {
-                    pieceInProgress_->SaveBlock(offset, blocks);
-                    if (pieceInProgress_->AllBlocksRetrieved()) {
-                        pieceStorage_.PieceProcessed(pieceInProgress_);
-                        pieceInProgress_ = nullptr;
-                    }
-                }
-                pendingBlock_.store(false);
-            }
-            else if (id == MessageId::Choke) {
-                Terminate();
-            }
-            else if (id == MessageId::Unchoke) {
-                choked_ = false;
-            }
-            else {
-                throw std::runtime_error("WRONG MessageId!");
-            }
-        }
+std::deque<PeerConnect::PendingRequest>::iterator PeerConnect::FindPendingRequest(size_t pieceIndex, size_t offset) {
+    return std::find_if(pendingRequests_.begin(), pendingRequests_.end(),
+                        [pieceIndex, offset] (const PendingRequest& pending) {
+        return pending.piece->GetIndex() == pieceIndex && pending.offset == offset;
+    });
+}
 
-        if (!choked_ && !pendingBlock_) {
-            RequestPiece();
-        }
+void PeerConnect::CompleteRequest(std::deque<PendingRequest>::iterator request, size_t length) {
+    double responseTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - request->sentAt).count();
+    minResponseTime_ = (minResponseTime_ == 0 ? responseTime : std::min(minResponseTime_, responseTime));
+    pendingRequests_.erase(request);
+    bytesSinceRateUpdate_ += length;
+    deliveredData_.store(true);
+}
+
+void PeerConnect::BlockRetrieved(const PiecePtr& piece) {
+    if (!piece->AllBlocksRetrieved()) {
+        return;
+    }
+    auto position = std::find(piecesInProgress_.begin(), piecesInProgress_.end(), piece);
+    if (position != piecesInProgress_.end()) {
+        piecesInProgress_.erase(position);
+        pieceStorage_.PieceProcessed(piece);
+    }
+}
+
+void PeerConnect::UpdatePipelineWindow(std::chrono::steady_clock::time_point now) {
+    double elapsed = std::chrono::duration<double>(now - lastRateUpdate_).count();
+    double rate = bytesSinceRateUpdate_ / elapsed;
+    downloadRate_ = (1 - SMOOTHING) * downloadRate_ + SMOOTHING * rate;
+    uploadRate_ = (1 - SMOOTHING) * uploadRate_ + SMOOTHING * (bytesUploadedSinceRateUpdate_ / elapsed);
+    bytesSinceRateUpdate_ = 0;
+    bytesUploadedSinceRateUpdate_ = 0;
+    lastRateUpdate_ = now;
+    choker_.UpdatePeer(this, downloadRate_, uploadRate_, peerInterested_);
+
+    // держим в полете вдвое больше блоков, чем помещается в произведение скорости на задержку
+    double bandwidthDelayBlocks = downloadRate_ * minResponseTime_ / BLOCK_SIZE;
+    size_t window = static_cast<size_t>(std::ceil(2 * bandwidthDelayBlocks));
+    pipelineWindow_ = std::clamp(window, pipeline_.minPendingBlocks, pipeline_.maxPendingBlocks);
+}
+
+void PeerConnect::ReleasePiecesInProgress() {
+    if (incomingBlock_.has_value()) {
+        incomingBlock_->piece->AbortBlockWrite(incomingBlock_->offset);
+        incomingBlock_.reset();
+    }
+    for (const PendingRequest& request : pendingRequests_) {
+        request.piece->CancelBlock(request.offset);
+    }
+    pendingRequests_.clear();
+    for (const PiecePtr& piece : piecesInProgress_) {
+        pieceStorage_.ReleasePiece(piece);
     }
+    piecesInProgress_.clear();
 }
+
 void PeerConnect::Terminate() {
+    if (terminated_.exchange(true)) {
+        return;
+    }
     peersCount_.fetch_sub(1);
-    terminated_.store(true);
+    choker_.RemovePeer(this);
+    ReleasePiecesInProgress();
+    uploadRequests_.clear();
+    if (availabilityRegistered_) {
+        pieceStorage_.RemovePeer(piecesAvailability_);
+        availabilityRegistered_ = false;
+    }
+    socket_.CloseConnection();
+    state_ = State::Closed;
+}
+
+bool PeerConnect::Terminated() const {
+    return terminated_;
 }
 
 bool PeerConnect::Failed() const {
     return failed_;
-}
\ No newline at end of file
+}
+
+bool PeerConnect::Established() const {
+    return established_;
+}
+
+bool PeerConnect::DeliveredData() const {
+    return deliveredData_;
+}
+
+bool PeerConnect::Inbound() const {
+    return inbound_;
+}
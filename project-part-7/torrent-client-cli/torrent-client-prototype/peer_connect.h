@@ -1,102 +1,264 @@
 #pragma once
 
 #include "tcp_connect.h"
+#include "choker.h"
 #include "peer.h"
+#include "peer_listener.h"
 #include "torrent_file.h"
 #include "piece_storage.h"
+#include "peer_pieces_availability.h"
+#include "message.h"
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <string_view>
+#include <vector>
 
 /*
- * Структура, хранящая информацию о доступности частей скачиваемого файла у данного пира
+ * Настройки конвейера запросов блоков к одному пиру.
+ * Пиру одновременно отправляется несколько запросов request, чтобы не ждать ответа на каждый блок.
+ * Размер окна подстраивается под измеренные скорость и время ответа пира (произведение скорости на задержку)
+ * и всегда лежит в пределах [minPendingBlocks, maxPendingBlocks]
  */
-class PeerPiecesAvailability {
+struct RequestPipelineSettings {
+    size_t minPendingBlocks = 16;
+    size_t maxPendingBlocks = 64;
+};
+
+/*
+ * Класс, представляющий соединение с одним пиром.
+ * С помощью него можно подключиться к пиру и обмениваться с ним сообщениями.
+ * Все операции неблокирующие: соединение -- это конечный автомат, который продвигает цикл событий
+ * (см. DownloadEngine), сообщая о готовности сокета через OnEvent и периодически вызывая OnTimer.
+ * Соединение может быть исходящим (мы подключаемся к пиру) или входящим (пир подключился к нам через
+ * PeerListener). В обоих случаях мы не только качаем части у пира, но и отдаем ему уже сохраненные на диск части:
+ * объявляем их через bitfield и Have и отвечаем на его запросы Request, читая блоки с диска прямо в очередь отправки.
+ * Кому из пиров отвечать, решает общий для всех соединений Choker. Если пир заблокировал нас (choke), соединение
+ * не закрывается: недокачанные части возвращаются в PieceStorage, а мы ждем unchoke, поддерживая соединение keep-alive.
+ * Все методы, кроме Terminate, вызываются только из потока цикла событий.
+ */
+class PeerConnect {
 public:
-    PeerPiecesAvailability();
+    /*
+     * Входящее соединение от пира, которое принял PeerListener. Соединение становится владельцем сокета в Start
+     */
+    PeerConnect(const PeerListener::Connection& accepted, const TorrentFile& tf, std::string selfPeerId,
+                PieceStorage& pieceStorage, Choker& choker, std::atomic<int>& peersCount,
+                RequestPipelineSettings pipeline = {}, const RateLimits& limits = {});
 
     /*
-     * bitfield -- массив байтов, в котором i-й бит означает наличие или отсутствие i-й части файла у пира
-     * https://wiki.theory.org/BitTorrentSpecification#bitfield:_.3Clen.3D0001.2BX.3E.3Cid.3D5.3E.3Cbitfield.3E
+     * Исходящее соединение по сокету, который уже подключил PeerConnector. Соединение становится владельцем сокета
+     * в Start и сразу отправляет handshake
      */
-    explicit PeerPiecesAvailability(std::string bitfield);
+    PeerConnect(const Peer& peer, int connectedSocket, const TorrentFile& tf, std::string selfPeerId,
+                PieceStorage& pieceStorage, Choker& choker, std::atomic<int>& peersCount,
+                RequestPipelineSettings pipeline = {}, const RateLimits& limits = {});
+
+    ~PeerConnect();
+
+    PeerConnect(const PeerConnect&) = delete;
+    PeerConnect& operator=(const PeerConnect&) = delete;
 
     /*
-     * Если ли часть под номером `pieceIndex` у пира?
+     * Начать работу с подключенным сокетом: исходящее соединение отправляет свой handshake, входящее ждет handshake
+     * пира. Сокет используется один раз, переподключиться после ошибки нельзя: новое соединение с тем же пиром
+     * создает PeerManager
      */
-    bool IsPieceAvailable(size_t pieceIndex) const;
+    void Start();
 
     /*
-     * Пометить часть под номером `pieceIndex` как доступную
+     * Обработать события epoll для сокета пира: прочитать и разобрать пришедшие сообщения,
+     * отправить накопившиеся данные.
+     * https://wiki.theory.org/BitTorrentSpecification#Messages
      */
-    void SetPieceAvailability(size_t pieceIndex);
+    void OnEvent(uint32_t events);
 
     /*
-     * Сколько бит хранится в bitfield'е
+     * Проверить таймауты подключения и чтения, применить решение Choker и дозапросить блоки, если PieceStorage
+     * раньше не мог выдать части
      */
-    size_t Size() const;
-private:
-    std::string bitfield_;
-};
+    void OnTimer(std::chrono::steady_clock::time_point now);
 
-/*
- * Класс, представляющий соединение с одним пиром.
- * С помощью него можно подключиться к пиру и обмениваться с ним сообщениями
- */
-class PeerConnect {
-public:
-    PeerConnect(const Peer& peer, const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage, std::atomic<int>& peersCount);
+    /*
+     * Обработать ошибку, возникшую в OnEvent или OnTimer: записать ее в лог и закрыть соединение
+     */
+    void OnError(const std::exception& error);
 
     /*
-     * Основная функция, в которой будет происходить цикл общения с пиром.
-     * https://wiki.theory.org/BitTorrentSpecification#Messages
+     * Какие события epoll нужно ждать для сокета пира. Пока ограничение скорости не дает читать или отправлять,
+     * соответствующее событие не ждем, и сокет пира снова проверяется по таймеру
      */
-    void Run();
+    uint32_t GetEvents();
 
+    int GetSocket() const;
+
+    /*
+     * Завершить общение с пиром. Недокачанная часть файла возвращается в PieceStorage
+     */
     void Terminate();
 
+    bool Terminated() const;
+
     /*
      * Соединение не удалось установить или оно было разорвано в результате ошибки.
+     * Для входящих соединений всегда false: переподключаться к ним некуда
      */
     bool Failed() const;
 
+    /*
+     * Соединение дошло до обмена сообщениями, то есть пир ответил на handshake и прислал bitfield.
+     * Остается true и после завершения соединения, сбрасывается при следующем Start.
+     * Можно вызывать из любого потока
+     */
+    bool Established() const;
+
+    /*
+     * Пир ответил хотя бы на один наш запрос блока. Как и Established, сбрасывается при следующем Start.
+     * Можно вызывать из любого потока
+     */
+    bool DeliveredData() const;
+
+    bool Inbound() const;
+
 private:
+    /*
+     * Запрос блока, на который пир еще не ответил
+     */
+    struct PendingRequest {
+        PiecePtr piece;
+        uint32_t offset;
+        std::chrono::steady_clock::time_point sentAt;
+    };
+
+    /*
+     * Блок, который пришел не целиком: остаток его данных читается из сокета прямо в буфер части
+     */
+    struct IncomingBlock {
+        PiecePtr piece;
+        uint32_t offset;
+        char* data;  // место блока в буфере части, см. Piece::BeginBlockWrite
+        size_t length;
+        size_t received;
+    };
+
+    /*
+     * Запрос блока от пира, на который мы еще не ответили
+     */
+    struct UploadRequest {
+        uint32_t piece;
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    /*
+     * Этапы жизни соединения
+     */
+    enum class State {
+        Handshake = 0,  // ждем handshake пира (исходящее соединение свой handshake уже отправило)
+        Bitfield,  // ждем bitfield или unchoke
+        Active,  // основной цикл обмена сообщениями
+        Closed,
+    };
+
+    /*
+     * Общая часть конструкторов: соединение с пиром без сокета, сокет задают открытые конструкторы
+     */
+    PeerConnect(const Peer& peer, const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage,
+                Choker& choker, std::atomic<int>& peersCount, RequestPipelineSettings pipeline,
+                const RateLimits& limits);
+
     const TorrentFile& tf_;
+    const size_t maxMessageSize_;  // длиннее сообщений от пира не бывает: это Piece с целым блоком или bitfield
     TcpConnect socket_;  // tcp-соединение с пиром
+    bool inbound_;  // пир подключился к нам сам
+    int connectedSocket_;  // уже подключенный сокет (входящий или от PeerConnector) до вызова Start
     const std::string selfPeerId_;  // наш id, которым представляется наш клиент
     std::string peerId_;  // id пира, с которым мы общаемся в текущем соединении
     PeerPiecesAvailability piecesAvailability_;
+    bool availabilityRegistered_;  // piecesAvailability_ учтен в PieceStorage при выборе редких частей
     std::atomic<bool> terminated_;  // флаг, необходимый для завершения цикла общения с пиром
     std::atomic<bool> choked_;  // https://wiki.theory.org/BitTorrentSpecification#Overview
-    PiecePtr pieceInProgress_;
+    bool amChoking_;  // мы не отвечаем на запросы блоков пира
+    Choker& choker_;
+    bool peerInterested_;  // пир хочет качать у нас
+    std::deque<UploadRequest> uploadRequests_;  // запросы пира в порядке поступления
+    size_t announcedPieces_;  // сколько частей из списка сохраненных в PieceStorage уже объявлено пиру
+    std::vector<PiecePtr> piecesInProgress_;  // части файла, которые скачиваются у этого пира
     PieceStorage& pieceStorage_;
-    std::atomic<bool> pendingBlock_;  // уже послали запрос на скачивание части файла и ждем ответ
+    std::deque<PendingRequest> pendingRequests_;  // отправленные запросы блоков в порядке отправки
+    std::optional<IncomingBlock> incomingBlock_;
+    const RequestPipelineSettings pipeline_;
+    size_t pipelineWindow_;  // сколько запросов блоков можно держать неотвеченными
+    double downloadRate_;  // сглаженная скорость скачивания у пира, байт/с
+    double uploadRate_;  // сглаженная скорость отдачи пиру, байт/с
+    double minResponseTime_;  // минимальное время ответа на запрос блока, оценка задержки без учета очереди, с
+    size_t bytesSinceRateUpdate_;
+    size_t bytesUploadedSinceRateUpdate_;
+    std::chrono::steady_clock::time_point lastRateUpdate_;
     std::atomic<bool> failed_;  // соединение не удалось установить или оно было разорвано в результате ошибки
+    std::atomic<bool> established_;  // соединение хотя бы раз доходило до состояния Active
+    std::atomic<bool> deliveredData_;  // пир прислал хотя бы один запрошенный блок
     std::atomic<int>& peersCount_;
+    State state_;
+    std::chrono::steady_clock::time_point lastActivity_;  // когда последний раз что-то пришло от пира
+    std::chrono::steady_clock::time_point lastKeepAlive_;  // когда мы последний раз отправили keep-alive
 
     /*
      * Функция производит handshake.
-     * - Подключиться к пиру по протоколу TCP
+     * - Подключение к пиру по протоколу TCP уже завершено
      * - Отправить пиру сообщение handshake
-     * - Проверить правильность ответа пира
+     * - Ответ пира проверяется в ReceiveHandshake, когда он придет целиком
      * https://wiki.theory.org/BitTorrentSpecification#Handshake
      */
     void PerformHandshake();
 
+    void SendHandshake();
+
+    /*
+     * Проверить правильность handshake пира. Возвращает false, если он пришел еще не целиком.
+     * Входящему пиру в ответ отправляется наш handshake, после чего любому пиру -- наш bitfield
+     */
+    bool ReceiveHandshake();
+
+    /*
+     * Отправить пиру bitfield с уже сохраненными на диск частями, если такие есть
+     */
+    void SendBitfield();
+
     /*
-     * - Провести handshake
-     * - Получить bitfield с информацией о наличии у пира различных частей файла
-     * - Сообщить пиру, что мы готовы получать от него данные (отправить interested)
-     * Возвращает true, если все три этапа прошли без ошибок
+     * Отправить пиру Have о частях, которые сохранены на диск после отправки bitfield
      */
-    bool EstablishConnection();
+    void AnnounceNewPieces();
 
     /*
-     * Функция читает из сокета bitfield с информацией о наличии у пира различных частей файла.
+     * Разобрать сообщения, которые уже лежат в буфере сокета. Сообщения разбираются прямо в буфере, без копирования
+     */
+    void ProcessMessages();
+
+    /*
+     * Прочитать и разобрать сообщения в основном цикле общения. Данные читаются порциями по 64 КиБ, из каждой
+     * разбираются все пришедшие целиком сообщения. Если блок последнего сообщения Piece пришел не целиком,
+     * его остаток читается из сокета прямо в буфер части.
+     * Возвращает false, если пир закрыл соединение
+     */
+    bool ReceiveMessages();
+
+    /*
+     * Функция обрабатывает первое после handshake сообщение с информацией о наличии у пира различных частей файла.
      * Полученную информацию надо сохранить в поле `piecesAvailability_`.
      * Также надо учесть, что сообщение тип Bitfield является опциональным, то есть пиры необязательно будут слать его.
-     * Вместо этого они могут сразу прислать сообщение Unchoke, поэтому надо быть готовым обработать его в этой функции.
-     * Обработка сообщения Unchoke заключается в выставлении флага `choked_` в значение `false`
+     * Вместо этого они могут сразу прислать любое другое сообщение (Unchoke, Interested, Have, ...), оно
+     * обрабатывается как обычно в HandleMessage
+     */
+    void ReceiveBitfield(std::string_view message);
+
+    /*
+     * Разобрать содержимое сообщения bitfield. Его длина должна быть ровно ceil(число частей / 8) байт,
+     * иначе выбрасывается исключение
      */
-    void ReceiveBitfield();
+    PeerPiecesAvailability ParseBitfield(std::string_view bitfield) const;
 
     /*
      * Функция посылает пиру сообщение типа interested
@@ -104,16 +266,108 @@ private:
     void SendInterested();
 
     /*
-     * Функция отправляет пиру сообщение типа request. Это сообщение обозначает запрос части файла у пира.
+     * Закодировать сообщение прямо в очередь отправки сокета
+     */
+    void SendMessage(const Message& message);
+
+    /*
+     * Функция отправляет пиру сообщения типа request, пока число неотвеченных запросов меньше окна конвейера.
      * За одно сообщение запрашивается не часть целиком, а блок данных размером 2^14 байт или меньше.
-     * Если в данный момент мы не знаем, какую часть файла надо запросить у пира, то надо получить эту информацию у
-     * PieceStorage
+     * Когда у скачиваемых частей не остается незапрошенных блоков, следующая часть берется у PieceStorage
+     */
+    void RequestPieces();
+
+    /*
+     * Найти незапрошенный блок среди частей, которые скачиваются у пира, или взять новую часть у PieceStorage
+     */
+    std::pair<PiecePtr, Block*> NextBlockToRequest();
+
+    /*
+     * Смещения блоков части `piece`, которые мы уже запросили у этого пира и ждем
+     */
+    std::vector<uint32_t> RequestedOffsets(const PiecePtr& piece) const;
+
+    /*
+     * Для режима endgame: отправить Cancel на запросы блоков, которые уже пришли от других пиров,
+     * и перестать качать полностью скачанные другими пирами части
+     */
+    void CancelReceivedBlocks();
+
+    /*
+     * Обработать одно сообщение пира в основном цикле общения
+     */
+    void HandleMessage(std::string_view message);
+
+    /*
+     * Если первым в буфере сокета лежит сообщение Piece, обработать его без копирования в строку.
+     * Если блок пришел не целиком, начать читать его остаток прямо в буфер части (см. ReceiveIncomingBlock).
+     * Возвращает false, если сообщение надо разбирать обычным образом или подождать остальные данные
+     */
+    bool ReceivePieceMessage();
+
+    /*
+     * Дочитать из сокета блок, начатый в ReceivePieceMessage. Возвращает false, если пир закрыл соединение
+     */
+    bool ReceiveIncomingBlock();
+
+    /*
+     * Сохранить пришедший блок. Блоки, которые мы не запрашивали, игнорируются
+     */
+    void ReceiveBlock(size_t pieceIndex, size_t offset, std::string_view data);
+
+    /*
+     * Найти наш запрос блока, на который пришел ответ
+     */
+    std::deque<PendingRequest>::iterator FindPendingRequest(size_t pieceIndex, size_t offset);
+
+    /*
+     * Учесть ответ на запрос блока в оценке задержки и скорости пира и убрать запрос из очереди
+     */
+    void CompleteRequest(std::deque<PendingRequest>::iterator request, size_t length);
+
+    /*
+     * Блок части `piece` сохранен. Если это был последний блок, отдать часть в PieceStorage
+     */
+    void BlockRetrieved(const PiecePtr& piece);
+
+    /*
+     * Запомнить запрос блока от пира. Запросы, пока пир заблокирован (choke), и запросы несохраненных частей
+     * игнорируются
+     */
+    void ReceiveRequest(const Message& message);
+
+    /*
+     * Пир отменил запрос блока, на который мы еще не ответили
+     */
+    void ReceiveCancel(const Message& message);
+
+    /*
+     * Прочитать с диска блоки по запросам пира прямо в очередь отправки, пока она не переполнится
+     */
+    void ServeUploadRequests();
+
+    /*
+     * Отправить очередь сокета, по мере ее опустошения добавляя в нее блоки по запросам пира
+     */
+    void SendQueuedData();
+
+    /*
+     * Заблокировать или разблокировать пира по решению Choker. При блокировке его запросы отбрасываются
+     */
+    void UpdateChoking(std::chrono::steady_clock::time_point now);
+
+    /*
+     * Пир заблокировал нас: его ответы на наши запросы больше не придут, поэтому части возвращаются в PieceStorage
+     */
+    void ReceiveChoke();
+
+    /*
+     * Пересчитать скорости скачивания у пира и отдачи ему, сообщить их Choker и пересчитать размер окна конвейера
      */
-    void RequestPiece();
+    void UpdatePipelineWindow(std::chrono::steady_clock::time_point now);
 
     /*
-     * Основной цикл общения с пиром. Здесь мы ждем следующее сообщение от пира и обрабатываем его.
-     * Также, если мы не ждем в данный момент от пира содержимого части файла, то надо отправить соответствующий запрос
+     * Вернуть недокачанные части файла в PieceStorage, чтобы их мог скачать другой пир
      */
-    void MainLoop();
+    void ReleasePiecesInProgress();
 };
@@ -0,0 +1,143 @@
+#include "peer_connector.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+    constexpr int MAX_EVENTS = 256;
+}
+
+PeerConnector::PeerConnector(std::chrono::milliseconds connectTimeout)
+        : connectTimeout_(connectTimeout)
+        , epoll_(epoll_create1(EPOLL_CLOEXEC)) {
+    if (epoll_ == -1) {
+        throw std::runtime_error("Error in epoll_create1!");
+    }
+}
+
+PeerConnector::~PeerConnector() {
+    for (const auto& [socket, connection] : pending_) {
+        close(socket);
+    }
+    for (const Result& result : completed_) {
+        if (result.socket != -1) {
+            close(result.socket);
+        }
+    }
+    close(epoll_);
+}
+
+void PeerConnector::Connect(const Peer& peer) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(peer.port);
+    if (inet_pton(AF_INET, peer.ip.c_str(), &address.sin_addr) != 1) {
+        completed_.push_back({peer, -1, "Bad peer address " + peer.ip});
+        return;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        completed_.push_back({peer, -1, std::string("Error in socket: ") + strerror(errno)});
+        return;
+    }
+    if (connect(sock, (struct sockaddr*)& address, sizeof(address)) == 0) {
+        completed_.push_back({peer, sock, ""});
+        return;
+    }
+    if (errno != EINPROGRESS) {
+        int error = errno;
+        close(sock);
+        completed_.push_back({peer, -1, std::string("Error in connect: ") + strerror(error)});
+        return;
+    }
+
+    epoll_event event{};
+    event.events = EPOLLOUT;
+    event.data.fd = sock;
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, sock, &event) == -1) {
+        close(sock);
+        completed_.push_back({peer, -1, "Error in epoll_ctl!"});
+        return;
+    }
+    pending_.emplace(sock, PendingConnection{peer, std::chrono::steady_clock::now() + connectTimeout_});
+}
+
+void PeerConnector::Watch(int eventFd) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = eventFd;
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, eventFd, &event) == -1) {
+        throw std::runtime_error("Error in epoll_ctl!");
+    }
+    watched_.insert(eventFd);
+}
+
+size_t PeerConnector::PendingCount() const {
+    return pending_.size();
+}
+
+std::vector<PeerConnector::Result> PeerConnector::Wait(std::chrono::milliseconds timeout) {
+    std::vector<Result> results;
+    results.swap(completed_);
+
+    auto now = std::chrono::steady_clock::now();
+    auto deadline = now + timeout;
+    for (const auto& [socket, connection] : pending_) {
+        deadline = std::min(deadline, connection.deadline);
+    }
+    int waitTime = results.empty() ?
+            static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(std::max(deadline - now,
+                    std::chrono::steady_clock::duration::zero())).count()) : 0;
+
+    epoll_event events[MAX_EVENTS];
+    int ready = epoll_wait(epoll_, events, MAX_EVENTS, waitTime);
+    if (ready == -1 && errno != EINTR) {
+        throw std::runtime_error("Error in epoll_wait!");
+    }
+    for (int i = 0; i < ready; ++i) {
+        int sock = events[i].data.fd;
+        if (watched_.count(sock) > 0) {
+            uint64_t value;
+            while (read(sock, &value, sizeof(value)) > 0) {}
+            continue;
+        }
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length) == -1) {
+            error = errno;
+        }
+        Complete(sock, error == 0 ? "" : std::string("Error in connect: ") + strerror(error), results);
+    }
+
+    now = std::chrono::steady_clock::now();
+    std::vector<int> expired;
+    for (const auto& [socket, connection] : pending_) {
+        if (connection.deadline <= now) {
+            expired.push_back(socket);
+        }
+    }
+    for (int sock : expired) {
+        Complete(sock, "Error with time of waiting!", results);
+    }
+    return results;
+}
+
+void PeerConnector::Complete(int socket, std::string error, std::vector<Result>& results) {
+    auto it = pending_.find(socket);
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, socket, nullptr);
+    if (!error.empty()) {
+        close(socket);
+        socket = -1;
+    }
+    results.push_back({std::move(it->second.peer), socket, std::move(error)});
+    pending_.erase(it);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "peer.h"
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/*
+ * Установка исходящих tcp соединений сразу со многими пирами из одного потока.
+ * Каждое подключение неблокирующее, все сокеты ждут EPOLLOUT в одном epoll, результат проверяется через SO_ERROR.
+ * Подключения не ждут друг друга: сокет отдается, как только подключение к нему завершилось, поэтому после ответа
+ * трекера первые пиры начинают handshake примерно через один RTT, а медленные и недоступные пиры никого не задерживают.
+ * Все методы вызываются из одного потока
+ */
+class PeerConnector {
+public:
+    explicit PeerConnector(std::chrono::milliseconds connectTimeout);
+
+    ~PeerConnector();
+
+    PeerConnector(const PeerConnector&) = delete;
+    PeerConnector& operator=(const PeerConnector&) = delete;
+
+    /*
+     * Результат подключения к пиру
+     */
+    struct Result {
+        Peer peer;
+        int socket;  // подключенный неблокирующий сокет или -1, если подключиться не удалось
+        std::string error;  // почему не удалось подключиться
+    };
+
+    /*
+     * Начать подключение к пиру. Если ошибка видна сразу, она вернется из ближайшего Wait
+     */
+    void Connect(const Peer& peer);
+
+    /*
+     * Прерывать Wait, когда становится читаемым eventfd `eventFd`, и сбрасывать его счетчик.
+     * Так в одном потоке можно ждать и подключений, и других событий. Дескриптор не закрывается PeerConnector
+     */
+    void Watch(int eventFd);
+
+    /*
+     * Сколько подключений еще не завершилось
+     */
+    size_t PendingCount() const;
+
+    /*
+     * Подождать не дольше `timeout`, пока завершится хотя бы одно подключение или сработает eventfd из Watch,
+     * и вернуть все завершившиеся подключения, в том числе прерванные по таймауту.
+     * Вызывающий становится владельцем возвращенных сокетов
+     */
+    std::vector<Result> Wait(std::chrono::milliseconds timeout);
+
+private:
+    struct PendingConnection {
+        Peer peer;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    const std::chrono::milliseconds connectTimeout_;
+    int epoll_;
+    std::unordered_map<int, PendingConnection> pending_;  // ключ -- сокет
+    std::unordered_set<int> watched_;  // eventfd из Watch
+    std::vector<Result> completed_;  // подключения, которые завершились еще в Connect
+
+    /*
+     * Снять сокет с ожидания и записать результат. При ошибке сокет закрывается
+     */
+    void Complete(int socket, std::string error, std::vector<Result>& results);
+};
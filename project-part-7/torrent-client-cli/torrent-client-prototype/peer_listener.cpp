@@ -0,0 +1,66 @@
+#include "peer_listener.h"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+    constexpr int LISTEN_BACKLOG = 64;
+}
+
+PeerListener::PeerListener(int port)
+        : sock_(socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))
+        , port_(port) {
+    if (sock_ == -1) {
+        throw std::runtime_error("Error in socket!");
+    }
+    int reuse = 1;
+    setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port_);
+    if (bind(sock_, (struct sockaddr*)& address, sizeof(address)) == -1 || listen(sock_, LISTEN_BACKLOG) == -1) {
+        int error = errno;
+        close(sock_);
+        throw std::runtime_error("Cannot listen on port " + std::to_string(port_) + ": " + strerror(error));
+    }
+}
+
+PeerListener::~PeerListener() {
+    close(sock_);
+}
+
+std::optional<PeerListener::Connection> PeerListener::Accept() {
+    while (true) {
+        struct sockaddr_in address;
+        socklen_t length = sizeof(address);
+        int socket = accept4(sock_, (struct sockaddr*)& address, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (socket != -1) {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &address.sin_addr, ip, sizeof(ip));
+            return Connection{socket, Peer{ip, ntohs(address.sin_port)}};
+        }
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return std::nullopt;
+        }
+        throw std::runtime_error(std::string("Error in accept: ") + strerror(errno));
+    }
+}
+
+int PeerListener::GetSocket() const {
+    return sock_;
+}
+
+int PeerListener::GetPort() const {
+    return port_;
+}
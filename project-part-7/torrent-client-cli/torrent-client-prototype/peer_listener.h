@@ -0,0 +1,43 @@
+#pragma once
+
+#include "peer.h"
+#include <cstdint>
+#include <optional>
+
+/*
+ * Слушающий tcp-сокет, через который к нам подключаются другие пиры, чтобы скачивать у нас части файла.
+ * Сокет неблокирующий: о новых подключениях сообщает epoll (см. DownloadEngine::Listen)
+ */
+class PeerListener {
+public:
+    /*
+     * Начать слушать порт `port` на всех интерфейсах. Если порт занят, выбрасывается исключение
+     */
+    explicit PeerListener(int port);
+
+    ~PeerListener();
+
+    PeerListener(const PeerListener&) = delete;
+    PeerListener& operator=(const PeerListener&) = delete;
+
+    /*
+     * Принятое входящее соединение: сокет и адрес подключившегося пира
+     */
+    struct Connection {
+        int socket;
+        Peer peer;
+    };
+
+    /*
+     * Принять одно ожидающее подключение. Если подключений больше нет, возвращается std::nullopt
+     */
+    std::optional<Connection> Accept();
+
+    int GetSocket() const;
+
+    int GetPort() const;
+
+private:
+    int sock_;
+    int port_;
+};
@@ -0,0 +1,167 @@
+#include "peer_manager.h"
+#include "peer_connect.h"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace {
+    std::string PeerKey(const Peer& peer) {
+        return peer.ip + ":" + std::to_string(peer.port);
+    }
+}
+
+PeerManager::PeerManager(std::vector<DownloadEngine*> engines, ConnectionFactory factory, PeerManagerSettings settings)
+        : engines_(std::move(engines))
+        , factory_(std::move(factory))
+        , settings_(settings)
+        , connector_(settings.connectTimeout)
+        , closeEvent_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+        , nextEngine_(0) {
+    if (closeEvent_ == -1) {
+        throw std::runtime_error("Error in eventfd!");
+    }
+    try {
+        if (engines_.empty()) {
+            throw std::invalid_argument("PeerManager needs at least one download engine!");
+        }
+        connector_.Watch(closeEvent_);
+    } catch (...) {
+        close(closeEvent_);
+        throw;
+    }
+    for (DownloadEngine* engine : engines_) {
+        engine->NotifyOnClose(closeEvent_);
+    }
+}
+
+PeerManager::~PeerManager() {
+    close(closeEvent_);
+}
+
+size_t PeerManager::AddPeers(const std::vector<Peer>& peers) {
+    size_t added = 0;
+    for (const Peer& peer : peers) {
+        std::string key = PeerKey(peer);
+        KnownPeer known;
+        known.peer = peer;
+        if (peers_.emplace(key, std::move(known)).second) {
+            order_.push_back(std::move(key));
+            ++added;
+        }
+    }
+    return added;
+}
+
+void PeerManager::Update(std::chrono::steady_clock::time_point now) {
+    size_t connections = connector_.PendingCount();
+    size_t connecting = connector_.PendingCount();
+    for (auto& [key, known] : peers_) {
+        if (known.connection == nullptr) {
+            continue;
+        }
+        if (known.connection->Terminated()) {
+            OnConnectionClosed(known, now);
+            continue;
+        }
+        ++connections;
+        if (!known.connection->Established()) {
+            ++connecting;
+        }
+        else if (IsHealthy(known, now)) {
+            known.failures = 0;
+        }
+    }
+
+    for (const std::string& key : order_) {
+        if (connections >= settings_.maxConnections || connecting >= settings_.maxConnecting) {
+            break;
+        }
+        KnownPeer& known = peers_.at(key);
+        if (known.connection != nullptr || known.connecting || known.banned || now < known.nextAttempt) {
+            continue;
+        }
+        connector_.Connect(known.peer);
+        known.connecting = true;
+        ++connections;
+        ++connecting;
+    }
+}
+
+void PeerManager::Wait(std::chrono::milliseconds timeout) {
+    auto now = std::chrono::steady_clock::now();
+    auto waitTime = std::chrono::ceil<std::chrono::milliseconds>(NextAttemptTime(now, now + timeout) - now);
+    std::vector<PeerConnector::Result> results = connector_.Wait(waitTime);
+    now = std::chrono::steady_clock::now();
+    for (PeerConnector::Result& result : results) {
+        KnownPeer& known = peers_.at(PeerKey(result.peer));
+        known.connecting = false;
+        if (result.socket == -1) {
+            std::cerr << "Failed to establish connection with peer " << result.peer.ip << ":" << result.peer.port <<
+                      " -- " << result.error << std::endl;
+            OnConnectFailed(known, now);
+            continue;
+        }
+        try {
+            known.connection = factory_(known.peer, result.socket);
+            known.connectedAt = now;
+        } catch (...) {
+            close(result.socket);
+            throw;
+        }
+        engines_[nextEngine_++ % engines_.size()]->AddPeer(known.connection);
+    }
+    Update(now);
+}
+
+bool PeerManager::IsHealthy(const KnownPeer& known, std::chrono::steady_clock::time_point now) const {
+    return known.connection->DeliveredData() || now - known.connectedAt >= settings_.healthyConnectionTime;
+}
+
+void PeerManager::OnConnectionClosed(KnownPeer& known, std::chrono::steady_clock::time_point now) {
+    bool healthy = known.connection->Established() && IsHealthy(known, now);
+    known.connection.reset();
+    if (healthy) {
+        known.failures = 0;
+        known.nextAttempt = now + settings_.minBackoff;
+        return;
+    }
+    OnConnectFailed(known, now);
+}
+
+void PeerManager::OnConnectFailed(KnownPeer& known, std::chrono::steady_clock::time_point now) {
+    ++known.failures;
+    if (known.failures >= settings_.maxFailures) {
+        known.banned = true;
+        std::cerr << "Peer " << known.peer.ip << ":" << known.peer.port << " is banned after " << known.failures <<
+                  " failed or short-lived connections in a row" << std::endl;
+        return;
+    }
+    size_t shift = std::min<size_t>(known.failures - 1, 16);
+    known.nextAttempt = now + std::min<std::chrono::seconds>(settings_.minBackoff * (1 << shift), settings_.maxBackoff);
+}
+
+void PeerManager::WakeOn(int eventFd) {
+    connector_.Watch(eventFd);
+}
+
+std::chrono::steady_clock::time_point PeerManager::NextAttemptTime(std::chrono::steady_clock::time_point now,
+                                                                   std::chrono::steady_clock::time_point limit) const {
+    for (const auto& [key, known] : peers_) {
+        if (known.connection == nullptr && !known.connecting && !known.banned && known.nextAttempt > now) {
+            limit = std::min(limit, known.nextAttempt);
+        }
+    }
+    return limit;
+}
+
+size_t PeerManager::ConnectionsCount() const {
+    size_t connections = connector_.PendingCount();
+    for (const auto& [key, known] : peers_) {
+        if (known.connection != nullptr && !known.connection->Terminated()) {
+            ++connections;
+        }
+    }
+    return connections;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "download_engine.h"
+#include "peer.h"
+#include "peer_connector.h"
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class PeerConnect;
+
+struct PeerManagerSettings {
+    size_t maxConnections = 50;  // сколько исходящих соединений держать одновременно, включая устанавливаемые
+    size_t maxConnecting = 32;  // сколько соединений может одновременно находиться в процессе установки
+    std::chrono::milliseconds connectTimeout{3000};  // сколько ждать завершения tcp подключения
+    std::chrono::seconds minBackoff{5};  // пауза перед повторным подключением к пиру после первой неудачи
+    std::chrono::seconds maxBackoff{300};  // пауза не растет дальше этого значения
+    size_t maxFailures = 5;  // после стольких неудачных попыток подряд пир попадает в бан-лист
+    std::chrono::seconds healthyConnectionTime{60};  // соединение, прожившее столько, считается удачным
+};
+
+/*
+ * Долгоживущий список известных пиров и исходящих соединений с ними, общий для всех обращений к трекеру.
+ * Пиры от трекера добавляются через AddPeers, повторы по ip:port отбрасываются, а уже работающие соединения
+ * не трогаются. Подключения ко всем кандидатам сразу (в пределах ограничений PeerManagerSettings) устанавливает
+ * PeerConnector, а готовые сокеты по мере подключения раздаются движкам по очереди.
+ * Если подключиться к пиру не удалось, следующая попытка откладывается экспоненциально: minBackoff, 2 * minBackoff
+ * и так далее до maxBackoff. После maxFailures неудач подряд пир больше не используется. Неудачей считается и
+ * соединение, которое закрылось после handshake, не прислав ни одного блока и не проработав healthyConnectionTime,
+ * иначе пир, рвущий соединение сразу после handshake, никогда не попал бы в бан-лист. Счетчик неудач
+ * сбрасывается, только когда соединение прислало данные или проработало healthyConnectionTime; такое соединение
+ * после закрытия восстанавливается через minBackoff.
+ * Все методы вызываются из одного потока
+ */
+class PeerManager {
+public:
+    /*
+     * Создать соединение с пиром по уже подключенному сокету
+     */
+    using ConnectionFactory = std::function<std::shared_ptr<PeerConnect>(const Peer&, int socket)>;
+
+    /*
+     * Run движков запускается после создания PeerManager и должен завершиться до его разрушения
+     */
+    PeerManager(std::vector<DownloadEngine*> engines, ConnectionFactory factory, PeerManagerSettings settings = {});
+
+    ~PeerManager();
+
+    PeerManager(const PeerManager&) = delete;
+    PeerManager& operator=(const PeerManager&) = delete;
+
+    /*
+     * Добавить пиров, полученных от трекера. Возвращает, сколько из них раньше не встречалось
+     */
+    size_t AddPeers(const std::vector<Peer>& peers);
+
+    /*
+     * Учесть завершившиеся соединения и начать подключения к новым пирам
+     */
+    void Update(std::chrono::steady_clock::time_point now);
+
+    /*
+     * Подождать не дольше `timeout` завершения подключений, передать подключенные сокеты движкам и вызвать Update.
+     * Возвращает раньше, если какое-то подключение завершилось, движок закрыл соединение, пора повторить попытку
+     * подключения к пиру или сработал eventfd из WakeOn
+     */
+    void Wait(std::chrono::milliseconds timeout);
+
+    /*
+     * Прерывать Wait, когда становится читаемым eventfd `eventFd` (например, PieceStorage::GetEventFd)
+     */
+    void WakeOn(int eventFd);
+
+    /*
+     * Сколько исходящих соединений сейчас открыто или устанавливается, включая tcp подключения в PeerConnector
+     */
+    size_t ConnectionsCount() const;
+
+private:
+    struct KnownPeer {
+        Peer peer;
+        std::shared_ptr<PeerConnect> connection;  // nullptr, если соединения нет
+        bool connecting = false;  // идет tcp подключение в PeerConnector
+        size_t failures = 0;  // неудачных попыток подключения или коротких соединений подряд
+        std::chrono::steady_clock::time_point connectedAt;  // когда было создано текущее соединение
+        std::chrono::steady_clock::time_point nextAttempt;  // раньше этого времени не подключаемся
+        bool banned = false;
+    };
+
+    const std::vector<DownloadEngine*> engines_;
+    const ConnectionFactory factory_;
+    const PeerManagerSettings settings_;
+    PeerConnector connector_;
+    int closeEvent_;  // eventfd, в который движки пишут о закрытых соединениях
+    std::unordered_map<std::string, KnownPeer> peers_;  // ключ -- "ip:port"
+    std::vector<std::string> order_;  // ключи peers_ в порядке добавления, в нем же перебираем кандидатов
+    size_t nextEngine_;
+
+    /*
+     * Соединение прислало данные или проработало healthyConnectionTime, и пир не стоит считать проблемным
+     */
+    bool IsHealthy(const KnownPeer& known, std::chrono::steady_clock::time_point now) const;
+
+    /*
+     * Соединение с пиром завершилось: решить, когда к нему можно подключиться снова
+     */
+    void OnConnectionClosed(KnownPeer& known, std::chrono::steady_clock::time_point now);
+
+    /*
+     * Подключиться к пиру не удалось или соединение с ним оборвалось слишком рано: отложить следующую попытку
+     * или забанить пира
+     */
+    void OnConnectFailed(KnownPeer& known, std::chrono::steady_clock::time_point now);
+
+    /*
+     * Когда закончится ближайшая пауза перед повторным подключением к пиру, но не позже `limit`
+     */
+    std::chrono::steady_clock::time_point NextAttemptTime(std::chrono::steady_clock::time_point now,
+                                                          std::chrono::steady_clock::time_point limit) const;
+};
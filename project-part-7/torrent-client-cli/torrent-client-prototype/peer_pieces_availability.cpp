@@ -0,0 +1,61 @@
+#include "peer_pieces_availability.h"
+#include <cstdint>
+#include <cstring>
+
+PeerPiecesAvailability::PeerPiecesAvailability()
+{}
+
+PeerPiecesAvailability::PeerPiecesAvailability(std::string bitfield)
+        : bitfield_(bitfield)
+{}
+
+PeerPiecesAvailability::PeerPiecesAvailability(size_t piecesCount)
+        : bitfield_((piecesCount + 7) / 8, '\0')
+{}
+
+bool PeerPiecesAvailability::IsPieceAvailable(size_t pieceIndex) const {
+    if (pieceIndex / 8 >= bitfield_.size()) {
+        return false;
+    }
+    return ((bitfield_[pieceIndex / 8] >> (7 - pieceIndex % 8)) & 1);
+}
+
+size_t PeerPiecesAvailability::NextAvailablePiece(size_t pieceIndex) const {
+    size_t byte = pieceIndex / 8;
+    if (byte >= bitfield_.size()) {
+        return bitfield_.size() * 8;
+    }
+    // старшие биты байта -- части с меньшими номерами, части до `pieceIndex` отбрасываем
+    unsigned int bits = static_cast<unsigned char>(bitfield_[byte]) & (0xFFu >> (pieceIndex % 8));
+    while (bits == 0) {
+        ++byte;
+        while (byte + sizeof(uint64_t) <= bitfield_.size()) {
+            uint64_t word;
+            std::memcpy(&word, bitfield_.data() + byte, sizeof(word));
+            if (word != 0) {
+                break;
+            }
+            byte += sizeof(word);
+        }
+        if (byte >= bitfield_.size()) {
+            return bitfield_.size() * 8;
+        }
+        bits = static_cast<unsigned char>(bitfield_[byte]);
+    }
+    return byte * 8 + __builtin_clz(bits) - 24;
+}
+
+void PeerPiecesAvailability::SetPieceAvailability(size_t pieceIndex) {
+    if (pieceIndex / 8 >= bitfield_.size()) {
+        return;
+    }
+    bitfield_[pieceIndex / 8] |= (1 << (7 - (pieceIndex % 8)));
+}
+
+size_t PeerPiecesAvailability::Size() const {
+    size_t sz = 0;
+    for (auto& ch : bitfield_) {
+        sz += __builtin_popcount(static_cast<unsigned char>(ch));
+    }
+    return sz;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+
+/*
+ * Структура, хранящая информацию о доступности частей скачиваемого файла у данного пира
+ */
+class PeerPiecesAvailability {
+public:
+    PeerPiecesAvailability();
+
+    /*
+     * bitfield -- массив байтов, в котором i-й бит означает наличие или отсутствие i-й части файла у пира
+     * https://wiki.theory.org/BitTorrentSpecification#bitfield:_.3Clen.3D0001.2BX.3E.3Cid.3D5.3E.3Cbitfield.3E
+     */
+    explicit PeerPiecesAvailability(std::string bitfield);
+
+    /*
+     * Пир, у которого пока нет ни одной из `piecesCount` частей: место под все биты выделяется сразу
+     */
+    explicit PeerPiecesAvailability(size_t piecesCount);
+
+    /*
+     * Если ли часть под номером `pieceIndex` у пира?
+     */
+    bool IsPieceAvailable(size_t pieceIndex) const;
+
+    /*
+     * Номер первой доступной у пира части, не меньшего `pieceIndex`, или число бит в bitfield'е, если таких нет.
+     * Нулевые байты пропускаются по восемь за раз, поэтому перебор частей пира, у которого их мало, стоит
+     * примерно O(n / 64 + k), где k -- число его частей
+     */
+    size_t NextAvailablePiece(size_t pieceIndex) const;
+
+    /*
+     * Пометить часть под номером `pieceIndex` как доступную. Номера за пределами bitfield'а игнорируются:
+     * bitfield не растет, иначе один номер от пира мог бы заставить выделить сотни мегабайт
+     */
+    void SetPieceAvailability(size_t pieceIndex);
+
+    /*
+     * Сколько бит хранится в bitfield'е
+     */
+    size_t Size() const;
+private:
+    std::string bitfield_;
+};
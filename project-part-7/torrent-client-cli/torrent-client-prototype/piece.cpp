@@ -7,11 +7,16 @@ namespace {
     constexpr size_t BLOCK_SIZE = 1 << 14;
 }
 
-Piece::Piece(size_t index, size_t length, std::string hash)
+Piece::Piece(size_t index, size_t length, const Sha1Hash& hash, std::shared_ptr<BufferPool> pool)
 : index_(index)
 , length_(length)
 , hash_(hash)
-, blocks_(length / BLOCK_SIZE + (length % BLOCK_SIZE == 0 ? 0 : 1)) {
+, blocks_(length / BLOCK_SIZE + (length % BLOCK_SIZE == 0 ? 0 : 1))
+, pool_(std::move(pool))
+, hashedBlocks_(0) {
+    if (pool_->BufferSize() < length_) {
+        throw std::invalid_argument("Piece buffer is too small!");
+    }
     for (size_t i = 0; i < blocks_.size(); ++i) {
         blocks_[i].piece = static_cast<uint32_t>(index);
         blocks_[i].offset = static_cast<uint32_t>(BLOCK_SIZE * i);
@@ -22,22 +27,81 @@ Piece::Piece(size_t index, size_t length, std::string hash)
             blocks_[i].length = static_cast<uint32_t>(length % BLOCK_SIZE == 0 ? BLOCK_SIZE : length % BLOCK_SIZE);
         }
         blocks_[i].status = Block::Status::Missing;
+        blocks_[i].requesters = 0;
+        blocks_[i].receiving = false;
     }
 }
 
-bool Piece::HashMatches() const {
+Piece::~Piece() {
+    pool_->Release(std::move(data_));
+}
+
+bool Piece::HashMatches() {
+    std::lock_guard<std::mutex> hashLock(hashMutex_);
+    if (dataHash_.has_value()) {
+        return *dataHash_ == GetHash();
+    }
     return GetDataHash() == GetHash();
 }
 
-Block* Piece::FirstMissingBlock() {
-    auto it = blocks_.begin();
-    for (; it != blocks_.end(); ++it) {
-        if ((*it).status == Block::Status::Missing) {
-            return &(*it);
+void Piece::AdvanceHash() {
+    std::lock_guard<std::mutex> hashLock(hashMutex_);
+    while (!dataHash_.has_value()) {
+        const char* blockData;
+        size_t blockLength;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (blocks_[hashedBlocks_].status != Block::Status::Retrieved) {
+                return;
+            }
+            blockData = data_.get() + blocks_[hashedBlocks_].offset;
+            blockLength = blocks_[hashedBlocks_].length;
+        }
+        hasher_.Update(std::string_view(blockData, blockLength));
+        if (++hashedBlocks_ == blocks_.size()) {
+            dataHash_ = hasher_.Finish();
         }
     }
-    if (it == blocks_.end()) {
-        return nullptr;
+}
+
+Block* Piece::RequestMissingBlock() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& block : blocks_) {
+        if (block.status == Block::Status::Missing) {
+            block.status = Block::Status::Pending;
+            block.requesters = 1;
+            return &block;
+        }
+    }
+    return nullptr;
+}
+
+Block* Piece::RequestPendingBlock(const std::vector<uint32_t>& requestedOffsets) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& block : blocks_) {
+        if (block.status == Block::Status::Pending &&
+            std::find(requestedOffsets.begin(), requestedOffsets.end(), block.offset) == requestedOffsets.end()) {
+            ++block.requesters;
+            return &block;
+        }
+    }
+    return nullptr;
+}
+
+void Piece::CancelBlock(size_t blockOffset) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (blockOffset / BLOCK_SIZE >= blocks_.size()) {
+        return;
+    }
+    Block& block = blocks_[blockOffset / BLOCK_SIZE];
+    if (block.status != Block::Status::Pending) {
+        return;
+    }
+    if (block.requesters > 0) {
+        --block.requesters;
+    }
+    if (block.requesters == 0) {
+        block.status = Block::Status::Missing;
     }
 }
 
@@ -45,42 +109,112 @@ size_t Piece::GetIndex() const {
     return index_;
 }
 
-void Piece::SaveBlock(size_t blockOffset, std::string data) {
-    if (blocks_[blockOffset / BLOCK_SIZE].status != Block::Status::Pending) {
-        throw std::runtime_error("Block is not pending");
+size_t Piece::GetLength() const {
+    return length_;
+}
+
+bool Piece::SaveBlock(size_t blockOffset, std::string_view data) {
+    char* destination = BeginBlockWrite(blockOffset, data.size());
+    if (destination == nullptr) {
+        return false;
     }
-    blocks_[blockOffset / BLOCK_SIZE].status = Block::Status::Retrieved;
-    blocks_[blockOffset / BLOCK_SIZE].data = data;
+    std::copy(data.begin(), data.end(), destination);
+    FinishBlockWrite(blockOffset);
+    return true;
+}
+
+char* Piece::BeginBlockWrite(size_t blockOffset, size_t length) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Block& block = FindBlock(blockOffset, length);
+    if (block.status == Block::Status::Retrieved || block.receiving) {
+        return nullptr;
+    }
+    if (data_ == nullptr) {
+        data_ = pool_->Acquire();
+    }
+    block.receiving = true;
+    return data_.get() + blockOffset;
+}
+
+void Piece::FinishBlockWrite(size_t blockOffset) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Block& block = blocks_[blockOffset / BLOCK_SIZE];
+        block.receiving = false;
+        block.status = Block::Status::Retrieved;
+    }
+    AdvanceHash();
+}
+
+void Piece::AbortBlockWrite(size_t blockOffset) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    blocks_[blockOffset / BLOCK_SIZE].receiving = false;
+}
+
+Block& Piece::FindBlock(size_t blockOffset, size_t length) {
+    if (blockOffset % BLOCK_SIZE != 0 || blockOffset / BLOCK_SIZE >= blocks_.size()) {
+        throw std::runtime_error("Wrong block offset");
+    }
+    Block& block = blocks_[blockOffset / BLOCK_SIZE];
+    if (length != block.length) {
+        throw std::runtime_error("Wrong block length");
+    }
+    return block;
+}
+
+bool Piece::IsBlockRetrieved(size_t blockOffset) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (blockOffset / BLOCK_SIZE >= blocks_.size()) {
+        return false;
+    }
+    return blocks_[blockOffset / BLOCK_SIZE].status == Block::Status::Retrieved;
 }
 
 bool Piece::AllBlocksRetrieved() const {
+    return RemainingBlocksCount() == 0;
+}
+
+size_t Piece::RemainingBlocksCount() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t remaining = 0;
     for (const auto& block : blocks_) {
         if (block.status != Block::Status::Retrieved) {
-            return false;
+            ++remaining;
         }
     }
-    return true;
+    return remaining;
 }
 
-std::string Piece::GetData() const {
-    std::string download_data = "";
-    for (const auto& block : blocks_) {
-        download_data += block.data;
+std::string_view Piece::GetData() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (data_ == nullptr) {
+        return {};
     }
-    return download_data;
+    return std::string_view(data_.get(), length_);
+}
+
+void Piece::ReleaseData() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pool_->Release(std::move(data_));
 }
 
-std::string Piece::GetDataHash() const {
-    return CalculateSHA1(GetData());
+Sha1Hash Piece::GetDataHash() const {
+    return CalculateSHA1Hash(GetData());
 }
 
-const std::string& Piece::GetHash() const {
+const Sha1Hash& Piece::GetHash() const {
     return hash_;
 }
 
 void Piece::Reset() {
+    std::lock_guard<std::mutex> hashLock(hashMutex_);
+    hasher_.Reset();
+    hashedBlocks_ = 0;
+    dataHash_.reset();
+    std::lock_guard<std::mutex> lock(mutex_);
     for (auto& block : blocks_) {
         block.status = Block::Status::Missing;
-        block.data.clear();
+        block.requesters = 0;
     }
+    pool_->Release(std::move(data_));
 }
\ No newline at end of file
@@ -1,9 +1,13 @@
 #pragma once
 
+#include "byte_tools.h"
+#include "buffer_pool.h"
 #include <string>
+#include <string_view>
 #include <vector>
 #include <optional>
 #include <memory>
+#include <mutex>
 
 /*
  * Части файла скачиваются не за одно сообщение, а блоками размером 2^14 байт или меньше (последний блок обычно меньше)
@@ -20,11 +24,16 @@ struct Block {
     uint32_t offset;  // смещение начала блока относительно начала части файла в байтах
     uint32_t length;  // длина блока в байтах
     Status status;  // статус загрузки данного блока
-    std::string data;  // бинарные данные
+    uint32_t requesters;  // сколько пиров ждут этот блок (в режиме endgame один блок запрашивают у нескольких)
+    bool receiving;  // данные блока прямо сейчас пишутся в буфер части (см. Piece::BeginBlockWrite)
 };
 
 /*
- * Часть скачиваемого файла
+ * Часть скачиваемого файла.
+ * Данные всех блоков хранятся в одном непрерывном буфере, который берется из пула при первой записи блока
+ * и возвращается в пул после сохранения части на диск или при сбросе.
+ * В режиме endgame одну часть качают сразу несколько пиров из разных потоков, поэтому все методы
+ * потокобезопасны, а выдача блока на скачивание и смена его статуса происходят атомарно
  */
 class Piece {
 public:
@@ -32,18 +41,37 @@ public:
      * index -- номер части файла, нумерация начинается с 0
      * length -- длина части файла. Все части, кроме последней, имеют длину, равную `torrentFile.pieceLength`
      * hash -- хеш-сумма части файла, взятая из `torrentFile.pieceHashes`
+     * pool -- пул буферов размером не меньше `length`
      */
-    Piece(size_t index, size_t length, std::string hash);
+    Piece(size_t index, size_t length, const Sha1Hash& hash, std::shared_ptr<BufferPool> pool);
+
+    ~Piece();
 
     /*
-     * Совпадает ли хеш скачанных данных с ожидаемым
+     * Совпадает ли хеш скачанных данных с ожидаемым.
+     * Хеш считается по мере прихода блоков (см. FinishBlockWrite), поэтому здесь обычно остается только сравнить
      */
-    bool HashMatches() const;
+    bool HashMatches();
 
     /*
-     * Дать указатель на отсутствующий (еще не скачанный и не запрошенный) блок
+     * Дать указатель на отсутствующий (еще не скачанный и не запрошенный) блок и пометить его как Pending.
+     * Если таких блоков нет, возвращается nullptr
      */
-    Block* FirstMissingBlock();
+    Block* RequestMissingBlock();
+
+    /*
+     * Для режима endgame: дать указатель на блок, который уже запрошен кем-то (Pending), но не входит в
+     * `requestedOffsets` -- смещения блоков, которые уже запросил сам вызывающий. Вызывающий становится еще одним
+     * ожидающим блока
+     */
+    Block* RequestPendingBlock(const std::vector<uint32_t>& requestedOffsets);
+
+    /*
+     * Один из ожидающих блока больше его не ждет, например, пир, у которого его запросили, отключился.
+     * Блок снова становится отсутствующим, только когда его не ждет никто: в режиме endgame запросы того же
+     * блока у других пиров еще в пути. Смещения за пределами части игнорируются
+     */
+    void CancelBlock(size_t blockOffset);
 
     /*
      * Получить порядковый номер части файла
@@ -51,9 +79,40 @@ public:
     size_t GetIndex() const;
 
     /*
-     * Сохранить скачанные данные для какого-то блока
+     * Получить длину части файла в байтах
+     */
+    size_t GetLength() const;
+
+    /*
+     * Сохранить скачанные данные для какого-то блока.
+     * Возвращает false, если блок уже был скачан или его прямо сейчас записывает другой пир
+     * (в режиме endgame один блок может прийти от нескольких пиров)
      */
-    void SaveBlock(size_t blockOffset, std::string data);
+    bool SaveBlock(size_t blockOffset, std::string_view data);
+
+    /*
+     * Начать запись блока прямо в буфер части: возвращает указатель на место блока в буфере, куда вызывающий
+     * сам запишет `length` байт, после чего вызовет FinishBlockWrite или AbortBlockWrite.
+     * Пока запись не завершена, другие пиры этот блок записать не могут.
+     * Возвращает nullptr, если блок уже скачан или его записывает другой пир
+     */
+    char* BeginBlockWrite(size_t blockOffset, size_t length);
+
+    /*
+     * Запись блока, начатая в BeginBlockWrite, завершена, блок скачан.
+     * Блоки, идущие подряд от начала части, сразу подаются в потоковый расчет хеша
+     */
+    void FinishBlockWrite(size_t blockOffset);
+
+    /*
+     * Запись блока, начатая в BeginBlockWrite, прервана (например, пир отключился посреди блока)
+     */
+    void AbortBlockWrite(size_t blockOffset);
+
+    /*
+     * Скачан ли уже блок с данным смещением. Для смещения за пределами части возвращается false
+     */
+    bool IsBlockRetrieved(size_t blockOffset) const;
 
     /*
      * Скачали ли уже все блоки
@@ -61,19 +120,30 @@ public:
     bool AllBlocksRetrieved() const;
 
     /*
-     * Получить скачанные данные для части файла
+     * Сколько блоков еще не скачано
      */
-    std::string GetData() const;
+    size_t RemainingBlocksCount() const;
+
+    /*
+     * Получить скачанные данные для части файла без копирования.
+     * Вызывать только когда все блоки скачаны: после этого буфер никто не меняет до Reset или ReleaseData
+     */
+    std::string_view GetData() const;
+
+    /*
+     * Вернуть буфер с данными в пул, например, после сохранения части на диск
+     */
+    void ReleaseData();
 
     /*
      * Посчитать хеш по скачанным данным
      */
-    std::string GetDataHash() const;
+    Sha1Hash GetDataHash() const;
 
     /*
      * Получить хеш для части из .torrent файла
      */
-    const std::string& GetHash() const;
+    const Sha1Hash& GetHash() const;
 
     /*
      * Удалить все скачанные данные и отметить все блоки как Missing
@@ -82,8 +152,26 @@ public:
 
 private:
     const size_t index_, length_;
-    const std::string hash_;
+    const Sha1Hash hash_;
     std::vector<Block> blocks_;
+    std::shared_ptr<BufferPool> pool_;
+    std::unique_ptr<char[]> data_;  // данные части, nullptr пока ни один блок не начали записывать
+    mutable std::mutex mutex_;
+
+    Sha1Hasher hasher_;  // хеш блоков [0, hashedBlocks_)
+    size_t hashedBlocks_;
+    std::optional<Sha1Hash> dataHash_;  // хеш всей части, когда все блоки учтены в hasher_
+    std::mutex hashMutex_;  // защищает поля расчета хеша, берется раньше mutex_
+
+    /*
+     * Подать в hasher_ все скачанные блоки, идущие подряд после уже учтенных
+     */
+    void AdvanceHash();
+
+    /*
+     * Проверить смещение и длину блока и найти его. Вызывается под блокировкой
+     */
+    Block& FindBlock(size_t blockOffset, size_t length);
 };
 
 using PiecePtr = std::shared_ptr<Piece>;
@@ -0,0 +1,139 @@
+#include "piece_picker.h"
+#include <algorithm>
+#include <random>
+
+namespace {
+    // сколько кандидатов просмотреть в множестве, прежде чем перейти к перебору частей пира
+    constexpr size_t MAX_SCANNED_CANDIDATES = 64;
+}
+
+PiecePicker::PiecePicker(size_t piecesCount)
+        : availability_(piecesCount, 0)
+        , tieBreak_(piecesCount)
+        , candidate_(piecesCount, false)
+        , priority_(piecesCount, PiecePriority::Normal)
+        , candidatesCount_(0)
+        , windowFirst_(0)
+        , windowEnd_(0) {
+    std::mt19937 random(std::random_device{}());
+    for (uint32_t& key : tieBreak_) {
+        key = random();
+    }
+}
+
+void PiecePicker::AddPeer(const PeerPiecesAvailability& peer) {
+    for (size_t i = peer.NextAvailablePiece(0); i < availability_.size(); i = peer.NextAvailablePiece(i + 1)) {
+        ChangeAvailability(i, 1);
+    }
+}
+
+void PiecePicker::RemovePeer(const PeerPiecesAvailability& peer) {
+    for (size_t i = peer.NextAvailablePiece(0); i < availability_.size(); i = peer.NextAvailablePiece(i + 1)) {
+        ChangeAvailability(i, -1);
+    }
+}
+
+void PiecePicker::AddPieceAvailability(size_t pieceIndex) {
+    if (pieceIndex < availability_.size()) {
+        ChangeAvailability(pieceIndex, 1);
+    }
+}
+
+void PiecePicker::Add(size_t pieceIndex) {
+    if (!candidate_[pieceIndex]) {
+        candidate_[pieceIndex] = true;
+        CandidatesOf(pieceIndex).insert(MakeKey(pieceIndex));
+        ++candidatesCount_;
+    }
+}
+
+void PiecePicker::SetPriority(size_t pieceIndex, PiecePriority priority) {
+    if (candidate_[pieceIndex]) {
+        CandidatesOf(pieceIndex).erase(MakeKey(pieceIndex));
+    }
+    priority_[pieceIndex] = priority;
+    if (candidate_[pieceIndex]) {
+        CandidatesOf(pieceIndex).insert(MakeKey(pieceIndex));
+    }
+}
+
+void PiecePicker::SetWindow(size_t first, size_t count) {
+    windowFirst_ = std::min(first, candidate_.size());
+    windowEnd_ = std::min(first + count, candidate_.size());
+}
+
+std::optional<size_t> PiecePicker::Pick(const PeerPiecesAvailability& peer) {
+    for (size_t pieceIndex = windowFirst_; pieceIndex < windowEnd_; ++pieceIndex) {
+        if (candidate_[pieceIndex] && peer.IsPieceAvailable(pieceIndex)) {
+            Remove(pieceIndex);
+            return pieceIndex;
+        }
+    }
+    size_t scanned = 0;
+    for (auto candidates = candidates_.rbegin(); candidates != candidates_.rend(); ++candidates) {
+        // части, которых нет ни у одного пира, лежат в начале множества, их пропускаем сразу
+        for (auto it = candidates->lower_bound({1, 0, 0}); it != candidates->end(); ++it) {
+            if (++scanned > MAX_SCANNED_CANDIDATES) {
+                // у пира мало частей: дешевле один раз пройти по его bitfield'у, чем по всему множеству
+                std::optional<size_t> pieceIndex = FindInBitfield(peer);
+                if (pieceIndex.has_value()) {
+                    Remove(*pieceIndex);
+                }
+                return pieceIndex;
+            }
+            size_t pieceIndex = std::get<2>(*it);
+            if (peer.IsPieceAvailable(pieceIndex)) {
+                Remove(pieceIndex);
+                return pieceIndex;
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<size_t> PiecePicker::FindInBitfield(const PeerPiecesAvailability& peer) const {
+    std::optional<size_t> best;
+    for (size_t pieceIndex = peer.NextAvailablePiece(0); pieceIndex < candidate_.size();
+         pieceIndex = peer.NextAvailablePiece(pieceIndex + 1)) {
+        if (!candidate_[pieceIndex] || availability_[pieceIndex] == 0) {
+            continue;
+        }
+        if (!best.has_value() || priority_[pieceIndex] > priority_[*best] ||
+            (priority_[pieceIndex] == priority_[*best] && MakeKey(pieceIndex) < MakeKey(*best))) {
+            best = pieceIndex;
+        }
+    }
+    return best;
+}
+
+size_t PiecePicker::Size() const {
+    return candidatesCount_;
+}
+
+bool PiecePicker::Empty() const {
+    return candidatesCount_ == 0;
+}
+
+std::set<PiecePicker::Key>& PiecePicker::CandidatesOf(size_t pieceIndex) {
+    return candidates_[static_cast<size_t>(priority_[pieceIndex])];
+}
+
+void PiecePicker::Remove(size_t pieceIndex) {
+    CandidatesOf(pieceIndex).erase(MakeKey(pieceIndex));
+    candidate_[pieceIndex] = false;
+    --candidatesCount_;
+}
+
+PiecePicker::Key PiecePicker::MakeKey(size_t pieceIndex) const {
+    return {availability_[pieceIndex], tieBreak_[pieceIndex], static_cast<uint32_t>(pieceIndex)};
+}
+
+void PiecePicker::ChangeAvailability(size_t pieceIndex, int delta) {
+    if (candidate_[pieceIndex]) {
+        CandidatesOf(pieceIndex).erase(MakeKey(pieceIndex));
+    }
+    availability_[pieceIndex] += delta;
+    if (candidate_[pieceIndex]) {
+        CandidatesOf(pieceIndex).insert(MakeKey(pieceIndex));
+    }
+}
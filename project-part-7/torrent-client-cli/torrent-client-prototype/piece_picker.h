@@ -0,0 +1,107 @@
+#pragma once
+
+#include "peer_pieces_availability.h"
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <set>
+#include <tuple>
+#include <vector>
+
+/*
+ * Приоритет части. Части с более высоким приоритетом выдаются раньше независимо от того, насколько они редкие
+ */
+enum class PiecePriority : uint8_t {
+    Normal = 0,
+    High,
+};
+
+/*
+ * Выбор следующей части файла для скачивания по стратегии rarest first.
+ * Для каждой части хранится, у скольких подключенных пиров она есть (по bitfield'ам и сообщениям Have).
+ * Части, которые можно выдать на скачивание, лежат в упорядоченном множестве по возрастанию доступности,
+ * поэтому обновление доступности стоит O(log n). Пиру выдается самая редкая часть из тех, что у него есть;
+ * при равной доступности порядок случайный, чтобы разные пиры не брали одни и те же части.
+ * У пира с почти всеми частями подходящая часть находится среди первых кандидатов множества, и выдача стоит O(log n).
+ * Для пира с немногими частями обход множества ограничен 64 кандидатами, дальше перебираются только части пира
+ * с пропуском пустых участков bitfield'а: O(n / 64 + k), где k -- число частей пира. Точная структура для такого
+ * пира (свое упорядоченное множество кандидатов у каждого пира) сделала бы выдачу O(log n), но каждое изменение
+ * доступности части стоило бы O(p log n) для p пиров, а подключение сида -- O(n p log n) под блокировкой PieceStorage.
+ * AddPeer и RemovePeer так же перебирают только части пира
+ * Класс не потокобезопасен, синхронизацию обеспечивает PieceStorage.
+ */
+class PiecePicker {
+public:
+    explicit PiecePicker(size_t piecesCount);
+
+    /*
+     * Учесть части, которые есть у нового пира
+     */
+    void AddPeer(const PeerPiecesAvailability& peer);
+
+    /*
+     * Забыть части отключившегося пира
+     */
+    void RemovePeer(const PeerPiecesAvailability& peer);
+
+    /*
+     * У одного из пиров появилась часть `pieceIndex` (сообщение Have)
+     */
+    void AddPieceAvailability(size_t pieceIndex);
+
+    /*
+     * Разрешить выдавать часть на скачивание
+     */
+    void Add(size_t pieceIndex);
+
+    /*
+     * Задать приоритет части. По умолчанию у всех частей приоритет Normal
+     */
+    void SetPriority(size_t pieceIndex, PiecePriority priority);
+
+    /*
+     * Задать окно потокового режима: части [first, first + count) выдаются раньше всех остальных строго по порядку
+     * номеров, независимо от редкости и приоритета, потому что ближайшая к курсору чтения часть понадобится первой.
+     * count == 0 выключает окно
+     */
+    void SetWindow(size_t first, size_t count);
+
+    /*
+     * Выдать самую редкую часть с наибольшим приоритетом из тех, что есть у пира, и убрать ее из кандидатов.
+     * Если у пира нет ни одной подходящей части, возвращается std::nullopt
+     */
+    std::optional<size_t> Pick(const PeerPiecesAvailability& peer);
+
+    /*
+     * Сколько частей можно выдать на скачивание
+     */
+    size_t Size() const;
+
+    bool Empty() const;
+
+private:
+    // (доступность, случайный ключ, номер части)
+    using Key = std::tuple<uint32_t, uint32_t, uint32_t>;
+
+    std::vector<uint32_t> availability_;
+    std::vector<uint32_t> tieBreak_;
+    std::vector<bool> candidate_;
+    std::vector<PiecePriority> priority_;
+    std::array<std::set<Key>, 2> candidates_;  // кандидаты отдельно для каждого приоритета
+    size_t candidatesCount_;
+    size_t windowFirst_;
+    size_t windowEnd_;
+
+    std::set<Key>& CandidatesOf(size_t pieceIndex);
+
+    void Remove(size_t pieceIndex);
+
+    Key MakeKey(size_t pieceIndex) const;
+
+    /*
+     * Найти самую редкую часть с наибольшим приоритетом, перебрав части пира, а не множество кандидатов
+     */
+    std::optional<size_t> FindInBitfield(const PeerPiecesAvailability& peer) const;
+
+    void ChangeAvailability(size_t pieceIndex, int delta);
+};
@@ -1,54 +1,386 @@
 #include "piece_storage.h"
+#include "piece_verifier.h"
+#include "resume_data.h"
+#include "byte_tools.h"
 #include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
-PieceStorage::PieceStorage(const TorrentFile& tf, const std::filesystem::path& outputDirectory)
-        : tf_(tf)
+namespace {
+    constexpr size_t ENDGAME_BLOCKS_THRESHOLD = 256;
+    constexpr size_t MAX_FREE_PIECE_BUFFERS = 32;
+    constexpr size_t MAX_VERIFIER_THREADS = 8;
+    constexpr size_t MAX_BYTES_BEING_SAVED = 256 << 20;  // сколько скачанных данных может ждать проверки и записи
+    constexpr size_t MIN_PIECES_BEING_SAVED = 4;
+    constexpr std::chrono::seconds RESUME_SAVE_INTERVAL(5);
+
+    size_t VerifierThreadsCount() {
+        return std::clamp<size_t>(std::thread::hardware_concurrency(), 1, MAX_VERIFIER_THREADS);
+    }
+}
+
+PieceStorage::PieceStorage(const TorrentFile& tf, const std::filesystem::path& outputDirectory,
+                           PieceStorageSettings settings)
+        : bufferPool_(std::make_shared<BufferPool>(tf.pieceLength, MAX_FREE_PIECE_BUFFERS))
+        , picker_(tf.pieceHashes.size())
+        , downloaders_(tf.pieceHashes.size(), 0)
+        , endgame_(false)
+        , streamingWindow_(settings.streamingWindow)
+        , streamingCursor_(0)
+        , tf_(tf)
+        , layout_(tf)
         , outputDirectory_(outputDirectory)
-        , outputFile_(outputDirectory_ / tf_.name, std::ios::binary | std::ios::out) {
-            std::unique_lock<std::shared_mutex> lock(sh_mutex_);
-            outputFile_.seekp(tf_.length - 1);
-            outputFile_.write("\0", 1);
-            for (size_t i = 0; i < tf.length / tf.pieceLength; ++i) {
-                if (i < tf.length / tf.pieceLength - 1) {
-                    remainPieces_.push(std::make_shared<Piece>(Piece(i, tf.pieceLength, tf.pieceHashes[i])));
-                }
-                else {
-                    remainPieces_.push(std::make_shared<Piece>(Piece(i, tf.length % tf.pieceLength, tf.pieceHashes[i])));
-                }
-            };
-}
-
-PiecePtr PieceStorage::GetNextPieceToDownload() {
+        , wanted_(tf.pieceHashes.size(), false)
+        , wantedPiecesCount_(0)
+        , wantedPiecesSaved_(0)
+        , maxPiecesBeingSaved_(std::max(MIN_PIECES_BEING_SAVED, MAX_BYTES_BEING_SAVED / tf_.pieceLength))
+        , eventFd_(-1)
+        , lastResumeSave_(std::chrono::steady_clock::now())
+        , verifier_(VerifierThreadsCount()) {
+    std::vector<bool> savedPieces = FindSavedPieces(settings.resume);
+    outputFile_ = OpenFileStorage(settings.backend, outputDirectory_, layout_, settings.filePriorities);
+
+    std::unique_lock<std::shared_mutex> lock(sh_mutex_);
+    for (size_t i = 0; i < tf.pieceHashes.size(); ++i) {
+        size_t length = std::min(tf.pieceLength, tf.length - i * tf.pieceLength);
+        pieces_.push_back(std::make_shared<Piece>(i, length, tf.pieceHashes[i], bufferPool_));
+        FilePriority priority = GetPiecePriority(i, settings.filePriorities);
+        wanted_[i] = priority != FilePriority::Skip;
+        wantedPiecesCount_ += wanted_[i];
+        if (savedPieces[i]) {
+            piecesSavedToDisc_.push_back(i);
+            setOfPiecesSavedToDisc_.insert(i);
+            wantedPiecesSaved_ += wanted_[i];
+        }
+        else if (wanted_[i]) {
+            if (priority == FilePriority::High) {
+                picker_.SetPriority(i, PiecePriority::High);
+            }
+            picker_.Add(i);
+        }
+    }
+    AdvanceStreamingCursor();
+    if (wantedPiecesCount_ < pieces_.size()) {
+        std::cout << "Skipping " << pieces_.size() - wantedPiecesCount_ << " of " << pieces_.size()
+                  << " pieces that belong only to skipped files" << std::endl;
+    }
+    if (!piecesSavedToDisc_.empty()) {
+        std::cout << "Resuming download, " << piecesSavedToDisc_.size() << " of " << pieces_.size()
+                  << " pieces are already saved" << std::endl;
+    }
+    eventFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd_ == -1) {
+        throw std::runtime_error("Error in eventfd!");
+    }
+}
+
+PieceStorage::~PieceStorage() {
+    // задачи проверки частей пишут в eventFd_, поэтому сначала дожидаемся их
+    if (verifier_.IsActive()) {
+        verifier_.Terminate(true);
+    }
+    close(eventFd_);
+}
+
+FilePriority PieceStorage::GetPiecePriority(size_t pieceIndex,
+                                            const std::vector<FilePriority>& filePriorities) const {
+    FilePriority priority = FilePriority::Skip;
+    layout_.ForEachExtent(pieceIndex * tf_.pieceLength, tf_.pieceLength, [&] (const FileExtent& extent) {
+        FilePriority filePriority = extent.fileIndex < filePriorities.size() ? filePriorities[extent.fileIndex]
+                                                                             : FilePriority::Normal;
+        priority = std::max(priority, filePriority);
+    });
+    return priority;
+}
+
+std::vector<bool> PieceStorage::FindSavedPieces(ResumeMode mode) const {
+    std::vector<bool> savedPieces(tf_.pieceHashes.size(), false);
+    const uint64_t sizeOnDisk = layout_.SizeOnDisk(outputDirectory_);
+    if (mode == ResumeMode::Off || sizeOnDisk == 0) {
+        return savedPieces;
+    }
+    std::filesystem::path outputPath = outputDirectory_ / tf_.name;
+    if (mode == ResumeMode::Trust) {
+        // после сохранения .resume в файлы дописывались только другие части, поэтому файлы могут быть новее
+        std::optional<ResumeData> resume = LoadResumeData(ResumeDataPath(outputPath));
+        if (resume.has_value() && resume->infoHash == tf_.infoHash && resume->fileSize == tf_.length &&
+            sizeOnDisk == tf_.length && resume->savedPieces.size() >= savedPieces.size() &&
+            layout_.LatestModificationTime(outputDirectory_) >= resume->fileModificationTime) {
+            resume->savedPieces.resize(savedPieces.size());
+            return resume->savedPieces;
+        }
+    }
+    std::cout << "Checking pieces already saved to " << outputPath << std::endl;
+    return VerifyPiecesOnDisk(outputDirectory_, tf_, VerifierThreadsCount());
+}
+
+void PieceStorage::SaveResume(bool force) {
+    std::unique_lock<std::mutex> resumeLock(resumeMutex_, std::defer_lock);
+    if (force) {
+        resumeLock.lock();
+    }
+    else if (!resumeLock.try_lock() || std::chrono::steady_clock::now() - lastResumeSave_ < RESUME_SAVE_INTERVAL) {
+        return;
+    }
+    lastResumeSave_ = std::chrono::steady_clock::now();
+
+    ResumeData data;
+    data.infoHash = tf_.infoHash;
+    data.savedPieces.resize(tf_.pieceHashes.size(), false);
+    {
+        std::shared_lock<std::shared_mutex> lock(sh_mutex_);
+        for (size_t pieceIndex : piecesSavedToDisc_) {
+            data.savedPieces[pieceIndex] = true;
+        }
+    }
+    // в .resume попадают только части, данные которых уже записаны на диск
+    if (outputFile_->IsOpen()) {
+        outputFile_->Flush();
+    }
+    data.fileSize = tf_.length;
+    data.fileModificationTime = layout_.LatestModificationTime(outputDirectory_);
+    SaveResumeData(ResumeDataPath(outputDirectory_ / tf_.name), data);
+}
+
+PiecePtr PieceStorage::GetNextPieceToDownload(const PeerPiecesAvailability& peer) {
     std::unique_lock<std::shared_mutex> lock(sh_mutex_);
-    if (!remainPieces_.empty()) {
-        PiecePtr next_piece = remainPieces_.front();
-        remainPieces_.pop();
-        return next_piece;
+    if (piecesBeingSaved_.size() >= maxPiecesBeingSaved_) {
+        return nullptr;  // проверка и запись не успевают, новые части пока не раздаем
+    }
+    std::optional<size_t> pieceIndex = picker_.Pick(peer);
+    if (pieceIndex.has_value()) {
+        ++downloaders_[*pieceIndex];
+        piecesInProgress_.insert(*pieceIndex);
+        return pieces_[*pieceIndex];
     }
     else {
         return nullptr;
     }
 }
 
-void PieceStorage::AddPiece(const PiecePtr& piece) {
+PiecePtr PieceStorage::GetEndgamePiece(const PeerPiecesAvailability& peer, const std::vector<PiecePtr>& ownPieces) {
+    std::unique_lock<std::shared_mutex> lock(sh_mutex_);
+    if (!CheckEndgame()) {
+        return nullptr;
+    }
+    for (size_t pieceIndex : piecesInProgress_) {
+        const PiecePtr& piece = pieces_[pieceIndex];
+        if (!peer.IsPieceAvailable(pieceIndex) ||
+            std::find(ownPieces.begin(), ownPieces.end(), piece) != ownPieces.end() ||
+            piece->AllBlocksRetrieved()) {
+            continue;
+        }
+        ++downloaders_[pieceIndex];
+        return piece;
+    }
+    return nullptr;
+}
+
+void PieceStorage::ReleasePiece(const PiecePtr& piece) {
+    std::unique_lock<std::shared_mutex> lock(sh_mutex_);
+    size_t pieceIndex = piece->GetIndex();
+    if (--downloaders_[pieceIndex] > 0) {
+        return;
+    }
+    piecesInProgress_.erase(pieceIndex);
+    // полностью скачанную часть сдаст в PieceProcessed тот пир, который скачал последний блок
+    if (setOfPiecesSavedToDisc_.count(pieceIndex) == 0 && !piece->AllBlocksRetrieved()) {
+        picker_.Add(pieceIndex);
+    }
+    if (piecesInProgress_.empty()) {
+        NotifyEvent();
+    }
+}
+
+bool PieceStorage::IsEndgame() {
+    if (endgame_.load()) {
+        return true;
+    }
+    std::unique_lock<std::shared_mutex> lock(sh_mutex_);
+    return CheckEndgame();
+}
+
+bool PieceStorage::EndgameStarted() const {
+    return endgame_.load();
+}
+
+bool PieceStorage::CheckEndgame() {
+    if (endgame_.load()) {
+        return true;
+    }
+    if (!picker_.Empty()) {
+        return false;
+    }
+    size_t remainingBlocks = 0;
+    for (size_t pieceIndex : piecesInProgress_) {
+        remainingBlocks += pieces_[pieceIndex]->RemainingBlocksCount();
+    }
+    if (remainingBlocks < ENDGAME_BLOCKS_THRESHOLD) {
+        endgame_.store(true);
+        std::cout << "Entering endgame mode, " << remainingBlocks << " blocks left" << std::endl;
+    }
+    return endgame_.load();
+}
+
+void PieceStorage::AddPeer(const PeerPiecesAvailability& peer) {
+    {
+        std::unique_lock<std::shared_mutex> lock(sh_mutex_);
+        picker_.AddPeer(peer);
+    }
+    NotifyEvent();
+}
+
+void PieceStorage::RemovePeer(const PeerPiecesAvailability& peer) {
+    {
+        std::unique_lock<std::shared_mutex> lock(sh_mutex_);
+        picker_.RemovePeer(peer);
+    }
+    NotifyEvent();
+}
+
+void PieceStorage::PeerHasPiece(size_t pieceIndex) {
     std::unique_lock<std::shared_mutex> lock(sh_mutex_);
-    remainPieces_.push(piece);
+    picker_.AddPieceAvailability(pieceIndex);
 }
 
 void PieceStorage::PieceProcessed(const PiecePtr& piece) {
+    size_t pieceIndex = piece->GetIndex();
     std::unique_lock<std::shared_mutex> lock(sh_mutex_);
-    if (piece->HashMatches()) {
-        SavePieceToDisk(piece);
+    --downloaders_[pieceIndex];
+    if (setOfPiecesSavedToDisc_.count(pieceIndex) > 0 || !piecesBeingSaved_.insert(pieceIndex).second) {
+        return;
+    }
+    verifier_.PushTask([this, piece] () {
+        VerifyAndSavePiece(piece);
+    });
+}
+
+void PieceStorage::VerifyAndSavePiece(const PiecePtr& piece) {
+    size_t pieceIndex = piece->GetIndex();
+    bool saved = false;
+    try {
+        if (piece->HashMatches()) {
+            SavePieceToDisk(piece);
+            piece->ReleaseData();
+            saved = true;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Cannot save piece " << pieceIndex << ": " << e.what() << std::endl;
+    }
+
+    std::unique_lock<std::shared_mutex> lock(sh_mutex_);
+    piecesBeingSaved_.erase(pieceIndex);
+    if (saved) {
+        piecesInProgress_.erase(pieceIndex);
+        piecesSavedToDisc_.push_back(pieceIndex);
+        setOfPiecesSavedToDisc_.insert(pieceIndex);
+        wantedPiecesSaved_ += wanted_[pieceIndex];
+        AdvanceStreamingCursor();
     }
     else {
         piece->Reset();
-        remainPieces_.push(piece);
+        if (downloaders_[pieceIndex] == 0) {
+            piecesInProgress_.erase(pieceIndex);
+            picker_.Add(pieceIndex);
+        }
+    }
+    bool idle = piecesInProgress_.empty();
+    lock.unlock();
+    if (saved) {
+        pieceSaved_.notify_all();
+    }
+    if (saved || idle) {
+        NotifyEvent();
+    }
+
+    try {
+        SaveResume(false);
+    } catch (const std::exception& e) {
+        std::cerr << "Cannot save resume data: " << e.what() << std::endl;
+    }
+}
+
+void PieceStorage::AdvanceStreamingCursor() {
+    if (streamingWindow_ == 0) {
+        return;
+    }
+    while (streamingCursor_ < pieces_.size() &&
+           (!wanted_[streamingCursor_] || setOfPiecesSavedToDisc_.count(streamingCursor_) > 0)) {
+        ++streamingCursor_;
+    }
+    picker_.SetWindow(streamingCursor_, streamingWindow_);
+}
+
+RangeStatus PieceStorage::WaitForRange(size_t offset, size_t length, std::chrono::milliseconds timeout) {
+    if (length == 0 || offset >= tf_.length) {
+        return length == 0 ? RangeStatus::Available : RangeStatus::Unavailable;
+    }
+    const size_t first = offset / tf_.pieceLength;
+    const size_t last = (std::min(offset + length, tf_.length) - 1) / tf_.pieceLength;
+
+    std::unique_lock<std::shared_mutex> lock(sh_mutex_);
+    for (size_t pieceIndex = first; pieceIndex <= last; ++pieceIndex) {
+        if (!wanted_[pieceIndex] && setOfPiecesSavedToDisc_.count(pieceIndex) == 0) {
+            return RangeStatus::Unavailable;
+        }
+    }
+    if (streamingWindow_ > 0) {
+        streamingCursor_ = first;
+        AdvanceStreamingCursor();
+    }
+    // части сохраняются в произвольном порядке, поэтому после каждого пробуждения ждем первую недостающую
+    size_t missing = first;
+    auto available = [&] () {
+        while (missing <= last && setOfPiecesSavedToDisc_.count(missing) > 0) {
+            ++missing;
+        }
+        return missing > last || !outputFile_->IsOpen();
+    };
+    if (!pieceSaved_.wait_for(lock, timeout, available)) {
+        return RangeStatus::Timeout;
+    }
+    return missing > last ? RangeStatus::Available : RangeStatus::Unavailable;
+}
+
+std::pair<std::string, size_t> PieceStorage::GetBitfield() const {
+    std::vector<bool> saved(pieces_.size(), false);
+    std::shared_lock<std::shared_mutex> lock(sh_mutex_);
+    for (size_t pieceIndex : piecesSavedToDisc_) {
+        saved[pieceIndex] = true;
+    }
+    return {EncodeBitfield(saved), piecesSavedToDisc_.size()};
+}
+
+size_t PieceStorage::GetPiecesSavedSince(size_t position, std::vector<size_t>& pieces) const {
+    std::shared_lock<std::shared_mutex> lock(sh_mutex_);
+    pieces.insert(pieces.end(), piecesSavedToDisc_.begin() + std::min(position, piecesSavedToDisc_.size()),
+                  piecesSavedToDisc_.end());
+    return piecesSavedToDisc_.size();
+}
+
+bool PieceStorage::HasPiece(size_t pieceIndex) const {
+    std::shared_lock<std::shared_mutex> lock(sh_mutex_);
+    return setOfPiecesSavedToDisc_.count(pieceIndex) > 0;
+}
+
+void PieceStorage::ReadBlock(size_t pieceIndex, size_t offset, size_t length, char* data) const {
+    if (pieceIndex >= pieces_.size() || offset > pieces_[pieceIndex]->GetLength() ||
+        length > pieces_[pieceIndex]->GetLength() - offset) {
+        throw std::runtime_error("Block is out of piece bounds!");
     }
+    if (!HasPiece(pieceIndex)) {
+        throw std::runtime_error("Piece is not saved to disk yet!");
+    }
+    // сохраненная часть больше не меняется, поэтому читать ее можно без блокировки
+    outputFile_->Read(pieceIndex * tf_.pieceLength + offset, data, length);
 }
 
 bool PieceStorage::QueueIsEmpty() const {
     std::shared_lock<std::shared_mutex> lock(sh_mutex_);
-    return remainPieces_.empty();
+    return picker_.Empty();
 }
 
 size_t PieceStorage::PiecesSavedToDiscCount() const {
@@ -61,13 +393,42 @@ size_t PieceStorage::TotalPiecesCount() const {
     return tf_.length / tf_.pieceLength + (tf_.length % tf_.pieceLength == 0 ? 0 : 1);
 }
 
+size_t PieceStorage::WantedPiecesCount() const {
+    std::shared_lock<std::shared_mutex> lock(sh_mutex_);
+    return wantedPiecesCount_;
+}
+
+size_t PieceStorage::WantedPiecesSavedCount() const {
+    std::shared_lock<std::shared_mutex> lock(sh_mutex_);
+    return wantedPiecesSaved_;
+}
+
+bool PieceStorage::AllWantedPiecesSaved() const {
+    std::shared_lock<std::shared_mutex> lock(sh_mutex_);
+    return wantedPiecesSaved_ >= wantedPiecesCount_;
+}
+
 void PieceStorage::CloseOutputFile() {
-    std::unique_lock<std::shared_mutex> lock(sh_mutex_);
-    if (outputFile_.is_open()) {
-        outputFile_.close();
+    if (verifier_.IsActive()) {
+        verifier_.Terminate(true);
     }
-    else {
-        throw std::runtime_error("OutputFile was closed early!");
+    {
+        std::unique_lock<std::shared_mutex> lock(sh_mutex_);
+        outputFile_->Close();
+    }
+    pieceSaved_.notify_all();
+    NotifyEvent();
+    SaveResume(true);
+}
+
+int PieceStorage::GetEventFd() const {
+    return eventFd_;
+}
+
+void PieceStorage::NotifyEvent() {
+    uint64_t value = 1;
+    if (write(eventFd_, &value, sizeof(value)) == -1) {
+        std::cerr << "Cannot notify about download event" << std::endl;
     }
 }
 
@@ -78,28 +439,9 @@ const std::vector<size_t>& PieceStorage::GetPiecesSavedToDiscIndices() const {
 
 size_t PieceStorage::PiecesInProgressCount() const {
     std::shared_lock<std::shared_mutex> lock(sh_mutex_);
-    return (tf_.length / tf_.pieceLength + (tf_.length % tf_.pieceLength == 0 ? 0 : 1)) - piecesSavedToDisc_.size() - remainPieces_.size();
+    return wantedPiecesCount_ - wantedPiecesSaved_ - picker_.Size();
 }
 
 void PieceStorage::SavePieceToDisk(const PiecePtr& piece) {
-    std::unique_lock<std::shared_mutex> lock(save_mutex_);
-    if (!outputFile_.is_open()) {
-        throw std::runtime_error("OutputFile is not open!");
-    }
-    else {
-        if(setOfPiecesSavedToDisc_.find(piece->GetIndex()) != setOfPiecesSavedToDisc_.end()) {
-            throw std::runtime_error("Piece already saved to disk!");
-        }
-        else {
-            outputFile_.seekp(piece->GetIndex() * tf_.pieceLength);
-            outputFile_.write(piece->GetData().data(), piece->GetData().size());
-            if (outputFile_.good()) {
-                piecesSavedToDisc_.push_back(piece->GetIndex());
-                setOfPiecesSavedToDisc_.insert(piece->GetIndex());
-            }
-            else {
-                throw std::runtime_error("Error while saving piece to disk!");
-            }
-        }
-    }
+    outputFile_->Write(piece->GetIndex() * tf_.pieceLength, piece->GetData());
 }
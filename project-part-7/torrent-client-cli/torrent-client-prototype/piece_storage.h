@@ -2,35 +2,156 @@
 
 #include "torrent_file.h"
 #include "piece.h"
-#include <queue>
+#include "piece_picker.h"
+#include "peer_pieces_availability.h"
+#include "file_layout.h"
+#include "file_storage.h"
+#include "thread_pool.h"
+#include <vector>
+#include <set>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <string>
 #include <unordered_set>
 #include <mutex>
 #include <shared_mutex>
-#include <fstream>
 #include <filesystem>
+#include <memory>
+
+/*
+ * Как продолжать прерванное скачивание при запуске
+ */
+enum class ResumeMode {
+    Off,  // скачать все части заново (данные в файлах при этом не стираются, а перезаписываются)
+    Trust,  // поверить файлу .resume, если он соответствует файлам на диске, иначе перепроверить хеши
+    Recheck,  // перепроверить хеши всех частей, уже лежащих в файлах
+};
+
+/*
+ * Результат ожидания диапазона байт в PieceStorage::WaitForRange
+ */
+enum class RangeStatus {
+    Available,  // все части диапазона записаны на диск
+    Timeout,  // части еще качаются, стоит подождать еще
+    Unavailable,  // диапазон не будет скачан: он задевает пропущенные файлы или выходные файлы уже закрыты
+};
+
+struct PieceStorageSettings {
+    StorageBackend backend = StorageBackend::Pwrite;
+    ResumeMode resume = ResumeMode::Trust;
+    std::vector<FilePriority> filePriorities;  // приоритеты файлов торрента по порядку, по умолчанию Normal
+    size_t streamingWindow = 0;  // сколько частей после курсора чтения качать по порядку; 0 -- обычный rarest first
+};
 
 /*
  * Хранилище информации о частях скачиваемого файла.
- * В этом классе отслеживается информация о том, какие части файла осталось скачать
+ * В этом классе отслеживается информация о том, какие части файла осталось скачать.
+ * Скачиваются только нужные части: те, что задевают хотя бы один файл с приоритетом не Skip. Приоритет части
+ * равен наибольшему приоритету задетых ею файлов, поэтому часть на стыке нужного и ненужного файла скачивается.
+ * В потоковом режиме части окна сразу за курсором чтения выдаются раньше остальных по порядку номеров, а читатель
+ * может дождаться появления на диске нужного ему диапазона байт через WaitForRange.
+ * Список сохраненных частей периодически записывается в файл .resume (см. ResumeData), чтобы после перезапуска
+ * не скачивать их заново
  */
 class PieceStorage {
 public:
-    PieceStorage(const TorrentFile& tf, const std::filesystem::path& outputDirectory);
+    PieceStorage(const TorrentFile& tf, const std::filesystem::path& outputDirectory,
+                 PieceStorageSettings settings = {});
+
+    ~PieceStorage();
+
+    PieceStorage(const PieceStorage&) = delete;
+    PieceStorage& operator=(const PieceStorage&) = delete;
+
+    /*
+     * Отдает указатель на следующую часть файла, которую надо скачать у пира с набором частей `peer`.
+     * Выбирается самая редкая среди подключенных пиров часть из тех, что есть у данного пира.
+     * Если у пира нет ни одной нужной нам части или слишком много скачанных частей ждут проверки и записи на диск,
+     * возвращается nullptr
+     */
+    PiecePtr GetNextPieceToDownload(const PeerPiecesAvailability& peer);
+
+    /*
+     * Для режима endgame: отдать часть, которую уже качают другие пиры, но у которой еще есть нескачанные блоки.
+     * Из рассмотрения исключаются части `ownPieces`, которые вызывающий пир уже качает.
+     * Режим включается, когда все части розданы пирам и нескачанных блоков осталось меньше порога.
+     * Если таких частей нет или режим еще не включен, возвращается nullptr
+     */
+    PiecePtr GetEndgamePiece(const PeerPiecesAvailability& peer, const std::vector<PiecePtr>& ownPieces);
+
+    /*
+     * Пир перестал качать часть (например, отключился). Уже скачанные блоки сохраняются, и если часть больше никто
+     * не качает, она возвращается в очередь на скачивание
+     */
+    void ReleasePiece(const PiecePtr& piece);
+
+    /*
+     * Проверить, пора ли включить режим endgame: все части розданы пирам и нескачанных блоков осталось меньше порога.
+     * Однажды включившись, режим остается включенным
+     */
+    bool IsEndgame();
+
+    /*
+     * Включен ли уже режим endgame. В отличие от IsEndgame, не берет блокировку
+     */
+    bool EndgameStarted() const;
+
+    /*
+     * Учесть набор частей подключившегося пира при выборе самых редких частей
+     */
+    void AddPeer(const PeerPiecesAvailability& peer);
 
     /*
-     * Отдает указатель на следующую часть файла, которую надо скачать
+     * Перестать учитывать набор частей отключившегося пира
      */
-    PiecePtr GetNextPieceToDownload();
+    void RemovePeer(const PeerPiecesAvailability& peer);
 
-    void AddPiece(const PiecePtr& piece);
+    /*
+     * У одного из подключенных пиров появилась часть `pieceIndex`
+     */
+    void PeerHasPiece(size_t pieceIndex);
 
     /*
      * Эта функция вызывается из PeerConnect, когда скачивание одной части файла завершено.
-     * В рамках данного задания требуется очистить очередь частей для скачивания как только хотя бы одна часть будет успешно скачана.
+     * Вызывающий пир при этом перестает качать часть. В режиме endgame одну и ту же часть могут сдать несколько
+     * пиров, повторные вызовы игнорируются.
+     * Проверка хеша и запись на диск выполняются в отдельном пуле потоков, вызывающий поток не ждет их окончания.
      */
     void PieceProcessed(const PiecePtr& piece);
 
+    /*
+     * Дождаться, пока все части, задевающие байты [offset, offset + length) потока байт торрента, будут проверены
+     * и записаны на диск, но не дольше `timeout`. В потоковом режиме курсор чтения переносится на начало диапазона,
+     * так что его части качаются в первую очередь.
+     * Если в диапазон попадают ненужные части пропущенных файлов, которые не будут скачаны, или выходные файлы
+     * уже закрыты, возвращает Unavailable не дожидаясь таймаута. Этим пользуется PieceStream
+     */
+    RangeStatus WaitForRange(size_t offset, size_t length, std::chrono::milliseconds timeout);
+
+    /*
+     * Битовая маска сохраненных на диск частей для сообщения bitfield и позиция в списке сохраненных частей,
+     * до которой маска их учитывает. Части, сохраненные позже, можно получить через GetPiecesSavedSince
+     */
+    std::pair<std::string, size_t> GetBitfield() const;
+
+    /*
+     * Дописать в `pieces` номера частей, сохраненных на диск после позиции `position` в списке сохраненных частей.
+     * Возвращает новую позицию, с которой надо продолжить в следующий раз
+     */
+    size_t GetPiecesSavedSince(size_t position, std::vector<size_t>& pieces) const;
+
+    /*
+     * Сохранена ли часть `pieceIndex` на диск, то есть можно ли отдавать ее другим пирам
+     */
+    bool HasPiece(size_t pieceIndex) const;
+
+    /*
+     * Прочитать с диска `length` байт сохраненной части `pieceIndex` начиная со смещения `offset` внутри части.
+     * Если часть еще не сохранена или диапазон выходит за ее границы, выбрасывается исключение
+     */
+    void ReadBlock(size_t pieceIndex, size_t offset, size_t length, char* data) const;
+
     /*
      * Остались ли нескачанные части файла?
      */
@@ -47,35 +168,114 @@ public:
     size_t TotalPiecesCount() const;
 
     /*
-     * Закрыть поток вывода в файл
+     * Сколько частей нужно скачать с учетом приоритетов файлов
+     */
+    size_t WantedPiecesCount() const;
+
+    /*
+     * Сколько нужных частей уже сохранено на диск
+     */
+    size_t WantedPiecesSavedCount() const;
+
+    /*
+     * Все ли нужные части уже сохранены на диск, то есть скачивать больше нечего и клиент только раздает
+     */
+    bool AllWantedPiecesSaved() const;
+
+    /*
+     * Дождаться проверки и записи уже скачанных частей, закрыть поток вывода в файл и сохранить файл .resume
      */
     void CloseOutputFile();
 
+    /*
+     * eventfd, через который хранилище сообщает о событиях скачивания, чтобы их можно было ждать в epoll вместе
+     * с сокетами, а не опрашивать счетчики: сохранена очередная часть (в том числе последняя из нужных), больше
+     * не скачивается ни одна часть (все пиры простаивают), подключился или отключился пир, закрыты выходные файлы.
+     * Дескриптор становится читаемым после события, сбрасывает его read. Закрывается в деструкторе
+     */
+    int GetEventFd() const;
+
     /*
      * Отдает список номеров частей файла, которые были сохранены на диск
      */
     const std::vector<size_t>& GetPiecesSavedToDiscIndices() const;
 
     /*
-     * Сколько частей файла в данный момент скачивается
+     * Сколько нужных частей файла в данный момент скачивается
      */
     size_t PiecesInProgressCount() const;
 
 private:
-    std::queue<PiecePtr> remainPieces_;
+    std::shared_ptr<BufferPool> bufferPool_;  // буферы под данные скачиваемых частей
+    std::vector<PiecePtr> pieces_;  // все части файла по порядку
+    PiecePicker picker_;  // части, которые осталось скачать
+    std::vector<uint32_t> downloaders_;  // сколько пиров сейчас качают каждую часть
+    std::set<size_t> piecesInProgress_;  // части, которые кто-то качает
+    std::atomic<bool> endgame_;
+    const size_t streamingWindow_;
+    size_t streamingCursor_;  // первая несохраненная нужная часть от курсора чтения
 
     TorrentFile tf_;
+    FileLayout layout_;
     std::filesystem::path outputDirectory_;
-    std::ofstream outputFile_;
-    std::vector<size_t> piecesSavedToDisc_;
+    std::unique_ptr<FileStorage> outputFile_;
+    std::vector<bool> wanted_;  // нужна ли часть с учетом приоритетов файлов
+    size_t wantedPiecesCount_;
+    size_t wantedPiecesSaved_;
+    std::vector<size_t> piecesSavedToDisc_;  // в порядке сохранения, только дописывается
     std::unordered_set<size_t> setOfPiecesSavedToDisc_;
+    std::unordered_set<size_t> piecesBeingSaved_;  // части, которые сейчас проверяются и пишутся на диск
+    const size_t maxPiecesBeingSaved_;
     mutable std::shared_mutex sh_mutex_;
-    mutable std::shared_mutex save_mutex_;
+    std::condition_variable_any pieceSaved_;  // сигналит о каждой сохраненной части и о закрытии файлов
+    int eventFd_;  // см. GetEventFd
+    std::mutex resumeMutex_;  // сохранение файла .resume
+    std::chrono::steady_clock::time_point lastResumeSave_;
+    ThreadPool verifier_;  // проверяет хеши и пишет части на диск; объявлен последним, чтобы первым остановиться
+
+    /*
+     * Какие части уже лежат в выходных файлах по данным файла .resume или по результатам перепроверки хешей.
+     * Вызывается из конструктора до открытия выходных файлов
+     */
+    std::vector<bool> FindSavedPieces(ResumeMode mode) const;
+
+    /*
+     * Наибольший приоритет среди файлов, которые задевает часть `pieceIndex`
+     */
+    FilePriority GetPiecePriority(size_t pieceIndex, const std::vector<FilePriority>& filePriorities) const;
+
+    /*
+     * Сдвинуть курсор чтения за уже сохраненные и ненужные части и передвинуть за ним окно потокового режима.
+     * Вызывается под эксклюзивной блокировкой
+     */
+    void AdvanceStreamingCursor();
+
+    /*
+     * Записать файл .resume, если с прошлой записи прошло достаточно времени или `force` == true
+     */
+    void SaveResume(bool force);
+
+    /*
+     * Задача пула verifier_: проверить хеш скачанной части и сохранить ее на диск.
+     * Если хеш не совпал или запись не удалась, часть скачивается заново
+     */
+    void VerifyAndSavePiece(const PiecePtr& piece);
 
     /*
      * Сохраняет данную скачанную часть файла на диск.
-     * Сохранение всех частей происходит в один выходной файл. Позиция записываемых данных зависит от индекса части
-     * и размера частей. Данные, содержащиеся в части файла, должны быть записаны сразу в правильную позицию.
+     * Позиция записываемых данных в потоке байт всех файлов торрента зависит от индекса части и размера частей,
+     * часть на стыке файлов делится между ними по layout_.
+     * Вызывается без блокировки sh_mutex_
+     */
+    void SavePieceToDisk(const PiecePtr& piece);
+
+    /*
+     * Проверить, не пора ли включить режим endgame. Вызывается под эксклюзивной блокировкой
+     */
+    bool CheckEndgame();
+
+    /*
+     * Сообщить о событии скачивания через eventFd_
      */
-     void SavePieceToDisk(const PiecePtr& piece);
+    void NotifyEvent();
 };
@@ -0,0 +1,117 @@
+#include "piece_stream.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <pthread.h>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+    // как часто проверять, не пора ли остановиться, пока ждем следующую часть или читателя канала
+    constexpr std::chrono::milliseconds WAIT_INTERVAL = 100ms;
+}
+
+PieceStream::PieceStream(PieceStorage& pieces, const TorrentFile& tf, std::filesystem::path output)
+        : pieces_(pieces)
+        , tf_(tf)
+        , output_(std::move(output))
+        , finishing_(false)
+        , bytesWritten_(0)
+        , thread_(&PieceStream::Run, this) {
+}
+
+PieceStream::~PieceStream() {
+    Finish();
+}
+
+void PieceStream::Finish() {
+    finishing_.store(true);
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+size_t PieceStream::BytesWritten() const {
+    return bytesWritten_.load();
+}
+
+int PieceStream::OpenOutput() {
+    while (true) {
+        // с O_NONBLOCK открытие канала без читателя не блокируется, а сразу завершается ошибкой ENXIO
+        int fd = open(output_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            int flags = fcntl(fd, F_GETFL, 0);
+            if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+                close(fd);
+                throw std::runtime_error("Error fcntl set flags!");
+            }
+            return fd;
+        }
+        if (errno != ENXIO) {
+            throw std::runtime_error("Cannot open stream output " + output_.string() + ": " + std::strerror(errno));
+        }
+        if (finishing_.load()) {
+            return -1;
+        }
+        std::this_thread::sleep_for(WAIT_INTERVAL);
+    }
+}
+
+void PieceStream::Run() {
+    // читатель канала может уйти раньше времени: тогда write вернет EPIPE, а не убьет процесс сигналом SIGPIPE
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    int fd = -1;
+    try {
+        fd = OpenOutput();
+        if (fd < 0) {
+            return;
+        }
+        std::vector<char> buffer(tf_.pieceLength);
+        for (size_t pieceIndex = 0; pieceIndex < tf_.pieceHashes.size(); ++pieceIndex) {
+            size_t offset = pieceIndex * tf_.pieceLength;
+            size_t length = std::min(tf_.pieceLength, tf_.length - offset);
+            RangeStatus status = pieces_.WaitForRange(offset, length, WAIT_INTERVAL);
+            while (status == RangeStatus::Timeout && !finishing_.load()) {
+                status = pieces_.WaitForRange(offset, length, WAIT_INTERVAL);
+            }
+            if (status == RangeStatus::Unavailable) {
+                std::cerr << "Stream to " << output_.string() << " stopped at byte " << offset <<
+                          ": this part of the torrent will not be downloaded" << std::endl;
+                break;
+            }
+            if (status == RangeStatus::Timeout) {
+                break;  // скачивание закончилось раньше, чем дошло до этой части
+            }
+
+            pieces_.ReadBlock(pieceIndex, 0, length, buffer.data());
+            size_t done = 0;
+            while (done < length) {
+                ssize_t written = write(fd, buffer.data() + done, length - done);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error("Error while writing stream: " + std::string(std::strerror(errno)));
+                }
+                done += written;
+            }
+            bytesWritten_.fetch_add(length);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Stream to " << output_.string() << " stopped: " << e.what() << std::endl;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "piece_storage.h"
+#include "torrent_file.h"
+#include <atomic>
+#include <cstddef>
+#include <filesystem>
+#include <thread>
+
+/*
+ * Потоковое чтение скачиваемого торрента: байты всех его файлов по порядку записываются в файл или именованный
+ * канал (например, его читает видеоплеер) по мере того, как части оказываются на диске.
+ * Каждую следующую часть поток ждет через PieceStorage::WaitForRange, а тот переносит туда курсор чтения, поэтому
+ * в потоковом режиме (PieceStorageSettings::streamingWindow) первыми качаются части сразу за уже записанными.
+ * Запись идет в отдельном потоке, чтобы медленный читатель канала не задерживал скачивание
+ */
+class PieceStream {
+public:
+    PieceStream(PieceStorage& pieces, const TorrentFile& tf, std::filesystem::path output);
+
+    /*
+     * Вызывает Finish, если его еще не вызывали
+     */
+    ~PieceStream();
+
+    PieceStream(const PieceStream&) = delete;
+    PieceStream& operator=(const PieceStream&) = delete;
+
+    /*
+     * Дописать уже сохраненные части, идущие подряд за записанными, и остановить поток, не дожидаясь остальных.
+     * Вызывается после окончания скачивания, пока выходные файлы PieceStorage еще открыты
+     */
+    void Finish();
+
+    /*
+     * Сколько байт потока уже записано
+     */
+    size_t BytesWritten() const;
+
+private:
+    PieceStorage& pieces_;
+    const TorrentFile& tf_;
+    const std::filesystem::path output_;
+    std::atomic<bool> finishing_;
+    std::atomic<size_t> bytesWritten_;
+    std::thread thread_;
+
+    void Run();
+
+    /*
+     * Открыть `output_` на запись. Именованный канал открывается, только когда у него появится читатель,
+     * поэтому ждем его, пока не вызван Finish. Возвращает -1, если открыть не удалось или ждать больше не нужно
+     */
+    int OpenOutput();
+};
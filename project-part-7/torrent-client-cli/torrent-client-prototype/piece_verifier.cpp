@@ -0,0 +1,173 @@
+#include "piece_verifier.h"
+#include "byte_tools.h"
+#include "file_layout.h"
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+    constexpr size_t READ_BATCH_SIZE = 8 << 20;  // сколько байт подряд идущих частей читается за раз
+
+    /*
+     * Отрезок подряд идущих частей [first, first + count), который читается за раз
+     */
+    struct Batch {
+        size_t first;
+        size_t count;
+    };
+
+    /*
+     * Прочитать до `length` байт с позиции `offset` файла. Возвращает, сколько байт удалось прочитать до конца файла
+     */
+    size_t ReadAt(int fd, char* data, size_t length, size_t offset) {
+        size_t done = 0;
+        while (done < length) {
+            ssize_t bytes_read = pread(fd, data + done, length - done, static_cast<off_t>(offset + done));
+            if (bytes_read == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Error in pread!");
+            }
+            if (bytes_read == 0) {
+                break;
+            }
+            done += bytes_read;
+        }
+        return done;
+    }
+
+    std::vector<Batch> SplitIntoBatches(std::vector<size_t> pieceIndices, size_t pieceLength) {
+        std::sort(pieceIndices.begin(), pieceIndices.end());
+        pieceIndices.erase(std::unique(pieceIndices.begin(), pieceIndices.end()), pieceIndices.end());
+        const size_t maxBatchPieces = std::max<size_t>(1, READ_BATCH_SIZE / pieceLength);
+        std::vector<Batch> batches;
+        for (size_t pieceIndex : pieceIndices) {
+            if (!batches.empty() && batches.back().first + batches.back().count == pieceIndex &&
+                batches.back().count < maxBatchPieces) {
+                ++batches.back().count;
+            }
+            else {
+                batches.push_back({pieceIndex, 1});
+            }
+        }
+        return batches;
+    }
+
+    /*
+     * Прочитать диапазон потока байт торрента из файлов `fds`. Возвращает, сколько байт подряд от начала диапазона
+     * удалось прочитать: чтение останавливается на первом отсутствующем или слишком коротком файле
+     */
+    size_t ReadRange(const FileLayout& layout, const std::vector<int>& fds, char* data, size_t length, size_t offset) {
+        size_t done = 0;
+        bool complete = true;
+        layout.ForEachExtent(offset, length, [&] (const FileExtent& extent) {
+            if (!complete) {
+                return;
+            }
+            int fd = fds[extent.fileIndex];
+            size_t bytesRead = fd < 0 ? 0 : ReadAt(fd, data + extent.dataOffset, extent.length, extent.fileOffset);
+            done += bytesRead;
+            complete = bytesRead == extent.length;
+        });
+        return done;
+    }
+}
+
+std::vector<bool> VerifyPiecesOnDisk(const std::filesystem::path& root, const TorrentFile& tf, size_t threadsCount,
+                                     std::vector<size_t> pieceIndices) {
+    const size_t piecesCount = tf.pieceHashes.size();
+    // vector<bool> нельзя писать из разных потоков, поэтому результаты сначала собираются побайтово
+    std::vector<char> matches(piecesCount, 0);
+    pieceIndices.erase(std::remove_if(pieceIndices.begin(), pieceIndices.end(),
+                                      [piecesCount] (size_t pieceIndex) { return pieceIndex >= piecesCount; }),
+                       pieceIndices.end());
+    const std::vector<Batch> batches = SplitIntoBatches(std::move(pieceIndices), tf.pieceLength);
+    threadsCount = std::clamp<size_t>(threadsCount, 1, std::max<size_t>(batches.size(), 1));
+
+    const FileLayout layout(tf);
+    std::vector<int> fds;
+    for (const TorrentFileEntry& file : layout.Files()) {
+        fds.push_back(open((root / file.path).c_str(), O_RDONLY | O_CLOEXEC));
+        if (fds.back() >= 0) {
+            posix_fadvise(fds.back(), 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+    }
+
+    auto batchRange = [&tf] (const Batch& batch) {
+        size_t offset = batch.first * tf.pieceLength;
+        return std::make_pair(offset, std::min(batch.count * tf.pieceLength, tf.length - offset));
+    };
+
+    std::atomic<size_t> nextBatch = 0;
+    auto worker = [&] () {
+        std::unique_ptr<char[]> buffer;
+        size_t bufferSize = 0;
+        for (size_t i = nextBatch++; i < batches.size(); i = nextBatch++) {
+            // пока этот поток хеширует свой кусок, ОС уже читает тот, до которого очередь дойдет позже
+            if (i + threadsCount < batches.size()) {
+                auto [aheadOffset, aheadLength] = batchRange(batches[i + threadsCount]);
+                layout.ForEachExtent(aheadOffset, aheadLength, [&fds] (const FileExtent& extent) {
+                    if (fds[extent.fileIndex] >= 0) {
+                        posix_fadvise(fds[extent.fileIndex], static_cast<off_t>(extent.fileOffset),
+                                      static_cast<off_t>(extent.length), POSIX_FADV_WILLNEED);
+                    }
+                });
+            }
+            auto [offset, length] = batchRange(batches[i]);
+            if (bufferSize < length) {
+                buffer = std::make_unique_for_overwrite<char[]>(length);
+                bufferSize = length;
+            }
+            size_t bytesRead = ReadRange(layout, fds, buffer.get(), length, offset);
+            for (size_t j = 0; j < batches[i].count; ++j) {
+                size_t pieceIndex = batches[i].first + j;
+                size_t pieceOffset = j * tf.pieceLength;
+                size_t pieceLength = std::min(tf.pieceLength, tf.length - pieceIndex * tf.pieceLength);
+                if (pieceOffset + pieceLength > bytesRead) {
+                    break;
+                }
+                std::string_view data(buffer.get() + pieceOffset, pieceLength);
+                matches[pieceIndex] = CalculateSHA1Hash(data) == tf.pieceHashes[pieceIndex];
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    for (size_t i = 0; i < threadsCount; ++i) {
+        threads.emplace_back([&] () {
+            try {
+                worker();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                error = std::current_exception();
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (int fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return std::vector<bool>(matches.begin(), matches.end());
+}
+
+std::vector<bool> VerifyPiecesOnDisk(const std::filesystem::path& root, const TorrentFile& tf, size_t threadsCount) {
+    std::vector<size_t> pieceIndices(tf.pieceHashes.size());
+    std::iota(pieceIndices.begin(), pieceIndices.end(), 0);
+    return VerifyPiecesOnDisk(root, tf, threadsCount, std::move(pieceIndices));
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "torrent_file.h"
+#include <filesystem>
+#include <vector>
+
+/*
+ * Проверить хеши частей `pieceIndices`, которые уже лежат в файлах торрента в директории `root`,
+ * в `threadsCount` потоков. Соседние части читаются из файлов одним большим куском, а следующие куски заранее
+ * запрашиваются у ОС через posix_fadvise, поэтому файлы читаются почти последовательно.
+ * Возвращает для каждой части торрента, совпал ли ее хеш. Части не из `pieceIndices` и части, которые не помещаются
+ * в файлы на диске, считаются несовпавшими
+ */
+std::vector<bool> VerifyPiecesOnDisk(const std::filesystem::path& root, const TorrentFile& tf, size_t threadsCount,
+                                     std::vector<size_t> pieceIndices);
+
+/*
+ * То же самое для всех частей торрента
+ */
+std::vector<bool> VerifyPiecesOnDisk(const std::filesystem::path& root, const TorrentFile& tf, size_t threadsCount);
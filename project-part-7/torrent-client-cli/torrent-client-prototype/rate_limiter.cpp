@@ -0,0 +1,98 @@
+#include "rate_limiter.h"
+#include <algorithm>
+#include <chrono>
+
+namespace {
+    constexpr int64_t BURST_DIVISOR = 5;  // ведро вмещает токены за 1/5 секунды
+    constexpr int64_t MIN_CAPACITY = 4096;
+    constexpr double NANOSECONDS_PER_SECOND = 1e9;
+
+    int64_t NowNanoseconds() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+}
+
+TokenBucket::TokenBucket(size_t rate) {
+    SetRate(rate);
+}
+
+void TokenBucket::SetRate(size_t rate) {
+    rate_ = rate;
+    capacity_ = std::max<int64_t>(static_cast<int64_t>(rate / BURST_DIVISOR), MIN_CAPACITY);
+    tokens_.store(capacity_);
+    lastRefill_.store(NowNanoseconds());
+}
+
+void TokenBucket::Refill() {
+    int64_t last = lastRefill_.load(std::memory_order_relaxed);
+    int64_t now = NowNanoseconds();
+    auto tokens = static_cast<int64_t>(static_cast<double>(now - last) * rate_ / NANOSECONDS_PER_SECOND);
+    if (tokens <= 0) {
+        return;
+    }
+    // сдвигаем время ровно на выданные токены, чтобы дробная часть не терялась при частых пополнениях
+    int64_t spent = static_cast<int64_t>(static_cast<double>(tokens) * NANOSECONDS_PER_SECOND / rate_);
+    if (!lastRefill_.compare_exchange_strong(last, last + spent, std::memory_order_relaxed)) {
+        return;  // другой поток уже пополнил ведро за этот промежуток
+    }
+    int64_t current = tokens_.load(std::memory_order_relaxed);
+    while (!tokens_.compare_exchange_weak(current, std::min(capacity_, current + tokens),
+                                          std::memory_order_relaxed)) {}
+}
+
+size_t TokenBucket::Acquire(size_t wanted) {
+    if (rate_ == 0) {
+        return wanted;
+    }
+    Refill();
+    int64_t current = tokens_.load(std::memory_order_relaxed);
+    int64_t granted;
+    do {
+        if (current <= 0) {
+            return 0;
+        }
+        granted = std::min<int64_t>(current, static_cast<int64_t>(wanted));
+    } while (!tokens_.compare_exchange_weak(current, current - granted, std::memory_order_relaxed));
+    return static_cast<size_t>(granted);
+}
+
+void TokenBucket::Release(size_t unused) {
+    if (rate_ != 0 && unused > 0) {
+        tokens_.fetch_add(static_cast<int64_t>(unused), std::memory_order_relaxed);
+    }
+}
+
+bool TokenBucket::HasTokens() {
+    if (rate_ == 0) {
+        return true;
+    }
+    Refill();
+    return tokens_.load(std::memory_order_relaxed) > 0;
+}
+
+void RateLimiter::Configure(TokenBucket* global, size_t peerRate) {
+    global_ = global;
+    peer_.SetRate(peerRate);
+}
+
+size_t RateLimiter::Acquire(size_t wanted) {
+    size_t granted = peer_.Acquire(wanted);
+    if (granted == 0 || global_ == nullptr) {
+        return granted;
+    }
+    size_t globalGranted = global_->Acquire(granted);
+    peer_.Release(granted - globalGranted);
+    return globalGranted;
+}
+
+void RateLimiter::Release(size_t unused) {
+    peer_.Release(unused);
+    if (global_ != nullptr) {
+        global_->Release(unused);
+    }
+}
+
+bool RateLimiter::CanTransfer() {
+    return peer_.HasTokens() && (global_ == nullptr || global_->HasTokens());
+}
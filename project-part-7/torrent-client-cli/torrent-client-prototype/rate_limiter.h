@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Ограничитель скорости "ведро с токенами": токены (байты) копятся со скоростью `rate` байт/с, но не больше,
+ * чем за 200 мс, и тратятся на чтение и запись в сокет. Токены выдаются сразу на весь вызов recv или send,
+ * а не на каждый байт, и без блокировок, поэтому одно ведро можно делить между потоками цикла событий.
+ * Скорость 0 означает отсутствие ограничения
+ */
+class TokenBucket {
+public:
+    explicit TokenBucket(size_t rate = 0);
+
+    TokenBucket(const TokenBucket&) = delete;
+    TokenBucket& operator=(const TokenBucket&) = delete;
+
+    /*
+     * Задать скорость и наполнить ведро. Вызывается, пока ведром никто не пользуется
+     */
+    void SetRate(size_t rate);
+
+    /*
+     * Взять до `wanted` токенов. Возвращает, сколько удалось взять, возможно 0
+     */
+    size_t Acquire(size_t wanted);
+
+    /*
+     * Вернуть взятые, но не потраченные токены (например, если recv прочитал меньше, чем разрешено)
+     */
+    void Release(size_t unused);
+
+    /*
+     * Есть ли сейчас хотя бы один токен
+     */
+    bool HasTokens();
+
+private:
+    size_t rate_;
+    int64_t capacity_;
+    std::atomic<int64_t> tokens_;
+    std::atomic<int64_t> lastRefill_;  // время последнего пополнения, нс от эпохи steady_clock
+
+    /*
+     * Добавить токены, накопившиеся с последнего пополнения. Пополняет тот поток, который первым сдвинет lastRefill_
+     */
+    void Refill();
+};
+
+/*
+ * Ограничение одного направления (скачивания или отдачи) одного соединения: собственное ведро соединения
+ * и общее для всех соединений ведро. Токены берутся сначала из своего ведра, затем из общего
+ */
+class RateLimiter {
+public:
+    RateLimiter() = default;
+
+    /*
+     * `global` может быть nullptr, `peerRate` 0 -- без ограничения для соединения
+     */
+    void Configure(TokenBucket* global, size_t peerRate);
+
+    size_t Acquire(size_t wanted);
+
+    void Release(size_t unused);
+
+    /*
+     * Можно ли сейчас передать хотя бы один байт
+     */
+    bool CanTransfer();
+
+private:
+    TokenBucket* global_ = nullptr;
+    TokenBucket peer_;
+};
+
+/*
+ * Ограничения скорости для соединений с пирами. Скорости в байтах/с, 0 -- без ограничения
+ */
+struct RateLimits {
+    TokenBucket* globalDownload = nullptr;
+    TokenBucket* globalUpload = nullptr;
+    size_t peerDownloadRate = 0;
+    size_t peerUploadRate = 0;
+};
@@ -0,0 +1,79 @@
+#include "resume_data.h"
+#include "bencode.h"
+#include "byte_tools.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+    std::string EncodeString(std::string_view value) {
+        return std::to_string(value.size()) + ":" + std::string(value);
+    }
+
+    std::string EncodeInt(int64_t value) {
+        return "i" + std::to_string(value) + "e";
+    }
+}
+
+std::filesystem::path ResumeDataPath(const std::filesystem::path& outputFile) {
+    std::filesystem::path path = outputFile;
+    path += ".resume";
+    return path;
+}
+
+int64_t FileModificationTime(const std::filesystem::path& path) {
+    return std::filesystem::last_write_time(path).time_since_epoch().count();
+}
+
+std::optional<ResumeData> LoadResumeData(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return std::nullopt;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    std::string contents = buffer.str();
+
+    try {
+        Bencode::Document document(contents);
+        const Bencode::NodeView& root = document.Root();
+        const Bencode::NodeView& bitfield = document.Get(root, "bitfield");
+        const Bencode::NodeView& infoHash = document.Get(root, "info_hash");
+        const Bencode::NodeView& mtime = document.Get(root, "mtime");
+        const Bencode::NodeView& size = document.Get(root, "size");
+        if (bitfield.type != Bencode::NodeView::Type::String || infoHash.type != Bencode::NodeView::Type::String ||
+            mtime.type != Bencode::NodeView::Type::Int || size.type != Bencode::NodeView::Type::Int ||
+            size.integer < 0) {
+            return std::nullopt;
+        }
+
+        ResumeData data;
+        data.infoHash = std::string(infoHash.string);
+        data.savedPieces = DecodeBitfield(bitfield.string);
+        data.fileSize = static_cast<uint64_t>(size.integer);
+        data.fileModificationTime = mtime.integer;
+        return data;
+    } catch (const std::exception& e) {
+        return std::nullopt;
+    }
+}
+
+void SaveResumeData(const std::filesystem::path& path, const ResumeData& data) {
+    std::string encoded = "d" +
+            EncodeString("bitfield") + EncodeString(EncodeBitfield(data.savedPieces)) +
+            EncodeString("info_hash") + EncodeString(data.infoHash) +
+            EncodeString("mtime") + EncodeInt(data.fileModificationTime) +
+            EncodeString("size") + EncodeInt(static_cast<int64_t>(data.fileSize)) +
+            "e";
+
+    std::filesystem::path temporaryPath = path;
+    temporaryPath += ".tmp";
+    {
+        std::ofstream file(temporaryPath, std::ios::binary | std::ios::out | std::ios::trunc);
+        file.write(encoded.data(), encoded.size());
+        if (!file.good()) {
+            throw std::runtime_error("Cannot write resume data to " + temporaryPath.string() + "!");
+        }
+    }
+    std::filesystem::rename(temporaryPath, path);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+/*
+ * Данные для быстрого продолжения скачивания (fast-resume). Хранятся рядом со скачиваемым файлом в файле
+ * `<имя файла>.resume` в формате bencode:
+ * d8:bitfield<битовая маска проверенных частей>9:info_hash<20 байт>5:mtimei<время изменения>e4:sizei<длина>ee
+ * Маска устроена так же, как в сообщении bitfield: старший бит первого байта соответствует части 0
+ */
+struct ResumeData {
+    std::string infoHash;
+    std::vector<bool> savedPieces;  // части, которые были проверены и записаны в файл
+    uint64_t fileSize;  // суммарный размер скачиваемых файлов в момент сохранения
+    int64_t fileModificationTime;  // время изменения самого нового из скачиваемых файлов в момент сохранения
+};
+
+/*
+ * Путь к файлу с данными для продолжения скачивания файла `outputFile`
+ */
+std::filesystem::path ResumeDataPath(const std::filesystem::path& outputFile);
+
+/*
+ * Время изменения файла в виде числа, которое сохраняется в ResumeData
+ */
+int64_t FileModificationTime(const std::filesystem::path& path);
+
+/*
+ * Прочитать данные для продолжения скачивания. Если файла нет или он поврежден, возвращается std::nullopt
+ */
+std::optional<ResumeData> LoadResumeData(const std::filesystem::path& path);
+
+/*
+ * Сохранить данные для продолжения скачивания. Файл сначала пишется во временный, а затем переименовывается,
+ * поэтому при падении посреди записи остается предыдущая версия
+ */
+void SaveResumeData(const std::filesystem::path& path, const ResumeData& data);
@@ -1,23 +1,25 @@
 #include "tcp_connect.h"
 #include "byte_tools.h"
 #include <sys/socket.h>
-#include <arpa/inet.h>
+#include <sys/uio.h>
 #include <stdexcept>
 #include <cstring>
-#include <iostream>
-#include <chrono>
-#include <netinet/in.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/poll.h>
-#include <limits>
+#include <algorithm>
 #include <utility>
+#include <cerrno>
 
-TcpConnect::TcpConnect(std::string ip, int port, std::chrono::milliseconds connectTimeout, std::chrono::milliseconds readTimeout)
+namespace {
+    constexpr size_t RECEIVE_CHUNK_SIZE = 1 << 16;
+    constexpr size_t MAX_RECEIVE_PER_CALL = 1 << 20;
+    constexpr size_t OUTPUT_CHUNK_SIZE = 1 << 16;
+    constexpr size_t MAX_SEND_SEGMENTS = 64;  // буферов за один sendmsg, с запасом меньше IOV_MAX
+}
+
+TcpConnect::TcpConnect(std::string ip, int port)
         : ip_(ip)
         , port_(port)
-        , connectTimeout_(connectTimeout)
-        , readTimeout_(readTimeout)
 {}
 
 TcpConnect::~TcpConnect() {
@@ -26,158 +28,277 @@ TcpConnect::~TcpConnect() {
     }
 }
 
-void TcpConnect::EstablishConnection() {
-    sock_ = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_ == -1) {
-        throw std::runtime_error("Error in socket!");
+void TcpConnect::CloseConnection() {
+    if (sock_status == 1) {
+        sock_status = 2;
+        close(sock_);
     }
+}
 
-    struct sockaddr_in address;
-
-    memset(&address, 0, sizeof(address));
-
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = inet_addr(ip_.c_str());
-    address.sin_port = htons(port_);
+void TcpConnect::AcceptConnection(int socket) {
+    CloseConnection();
+    inputBegin_ = 0;
+    inputEnd_ = 0;
+    ClearOutput();
 
+    sock_ = socket;
+    sock_status = 1;
     int flags = fcntl(sock_, F_GETFL, 0);
-    if (flags == -1) {
-        throw std::runtime_error("Error fcntl get flags!");
-    }
-
-    fcntl(sock_, F_SETFL, flags | O_NONBLOCK);
-    if (fcntl(sock_, F_SETFL, flags | O_NONBLOCK) == -1) {
+    if (flags == -1 || fcntl(sock_, F_SETFL, flags | O_NONBLOCK) == -1) {
         throw std::runtime_error("Error fcntl set flags!");
     }
+}
 
-    if (connect(sock_, (struct sockaddr*)& address, sizeof(address)) == 0) {
-        flags = fcntl(sock_, F_GETFL, 0);
-        if (flags == -1) {
-            throw std::runtime_error("Error fcntl get flags!");
-        }
-        if (fcntl(sock_, F_SETFL, flags & ~O_NONBLOCK) == -1) {
-            throw std::runtime_error("Error fcntl set flags!");
-        }
+void TcpConnect::SetRateLimits(const RateLimits& limits) {
+    downloadLimiter_.Configure(limits.globalDownload, limits.peerDownloadRate);
+    uploadLimiter_.Configure(limits.globalUpload, limits.peerUploadRate);
+}
+
+bool TcpConnect::CanReceive() {
+    receiveLimited_ = !downloadLimiter_.CanTransfer();
+    return !receiveLimited_;
+}
+
+bool TcpConnect::CanSend() {
+    return uploadLimiter_.CanTransfer();
+}
+
+bool TcpConnect::ReceiveLimited() const {
+    return receiveLimited_;
+}
+
+bool TcpConnect::SendLimited() const {
+    return sendLimited_;
+}
+
+bool TcpConnect::ReceiveAvailable(size_t maxSize) {
+    if (sock_status != 1) {
+        throw std::runtime_error("Socket was closed!");
     }
-    else {
-        struct pollfd fds;
-        memset(&fds, 0, sizeof(fds));
-        fds.fd = sock_;
-        fds.events = POLLOUT;
-        int ready = poll(&fds, 1, connectTimeout_.count());
-        if (ready == -1) {
-            throw std::runtime_error("Error in poll!");
-        }
-        else if (!ready) {
-//            CloseConnection();
-//            std::cerr << "Error waiting time: " << strerror(errno) << std::endl;
-            throw std::runtime_error("Error with time of waiting!");
-        }
-        else {
-            flags = fcntl(sock_, F_GETFL, 0);
-            if (flags == -1) {
-                throw std::runtime_error("Error fcntl get flags!");
+    size_t wanted = std::min(maxSize, MAX_RECEIVE_PER_CALL);
+    size_t limit = downloadLimiter_.Acquire(wanted);
+    receiveLimited_ = limit < wanted;
+    size_t received = 0;
+    bool open = true;
+    while (received < limit) {
+        size_t chunk = std::min(RECEIVE_CHUNK_SIZE, limit - received);
+        ReserveInputSpace(chunk);
+        ssize_t bytes_received = recv(sock_, inputBuffer_.data() + inputEnd_, chunk, 0);
+        if (bytes_received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
             }
-            if (fcntl(sock_, F_SETFL, flags & ~O_NONBLOCK) == -1) {
-                throw std::runtime_error("Error fcntl set flags!");
+            if (errno == EINTR) {
+                continue;
             }
+            downloadLimiter_.Release(limit - received);
+            throw std::runtime_error("Error in recv!");
+        }
+        else if (!bytes_received) {
+            open = false;
+            break;
+        }
+        inputEnd_ += bytes_received;
+        received += bytes_received;
+        if (static_cast<size_t>(bytes_received) < chunk) {
+            break;  // сокет опустел, следующий recv вернул бы EAGAIN
         }
     }
-    sock_status = 1;
+    downloadLimiter_.Release(limit - received);
+    return open;
 }
 
-void TcpConnect::SendData(const std::string& data) const {
-    if (sock_status == 2 || sock_ == -1) {
-        throw ("Socket was closed!");
+void TcpConnect::ReserveInputSpace(size_t size) {
+    if (inputBuffer_.size() - inputEnd_ >= size) {
+        return;
     }
-    const char* buf = data.c_str();
-    size_t len = data.size();
-    while (len > 0) {
-//        std::cout << "ПЕРЕД ОТПРАВКОЙ\n";
-        int bytes_sent;
-        if (sock_status == 1) {
-            bytes_sent = send(sock_, buf, len, MSG_NOSIGNAL);
-        }
-        else {
-            throw std::runtime_error("Socket was closed before the data was sent!");
-        }
-//        std::cout << "ПОСЛЕ ОТПРАВКИ\n";
-        if (bytes_sent == -1) {
-//            std::cerr << "Error sending data: " << strerror(errno) << std::endl;
-            throw std::runtime_error("Error send data!");
-        }
-        buf += bytes_sent;
-        len -= bytes_sent;
+    size_t unread = inputEnd_ - inputBegin_;
+    if (inputBegin_ > 0) {
+        std::memmove(inputBuffer_.data(), inputBuffer_.data() + inputBegin_, unread);
+        inputBegin_ = 0;
+        inputEnd_ = unread;
+    }
+    if (inputBuffer_.size() - inputEnd_ < size) {
+        inputBuffer_.resize(std::max(inputBuffer_.size() * 2, unread + size));
     }
 }
 
-std::string TcpConnect::ReceiveData(size_t bufferSize) const {
-    if (sock_status == 2 || sock_ == -1) {
-        throw ("Socket was closed!");
+bool TcpConnect::ExtractData(size_t size, std::string& data) {
+    if (inputEnd_ - inputBegin_ < size) {
+        return false;
+    }
+    data.assign(inputBuffer_.data() + inputBegin_, size);
+    ConsumeData(size);
+    return true;
+}
+
+bool TcpConnect::ExtractMessage(std::string_view& message, size_t maxSize) {
+    std::string_view buffered = BufferedData();
+    if (buffered.size() < 4) {
+        return false;
+    }
+    size_t size = ReadUint32BigEndian(buffered.data());
+    if (size > maxSize) {
+        throw std::runtime_error("Message is too long!");
     }
-    size_t sz = 4;
+    if (buffered.size() - 4 < size) {
+        return false;
+    }
+    message = buffered.substr(4, size);
+    ConsumeData(4 + size);
+    return true;
+}
 
-    struct pollfd fds;
-    memset(&fds, 0, sizeof(fds));
-    fds.fd = sock_;
-    fds.events = POLLIN;
+std::string_view TcpConnect::BufferedData() const {
+    return std::string_view(inputBuffer_.data() + inputBegin_, inputEnd_ - inputBegin_);
+}
 
-    if (!bufferSize) {
-        std::string len(4, 0);
-        char *lenbufptr = &len[0];
-        while (sz > 0) {
-            int ready = poll(&fds, 1, readTimeout_.count());
-            if (ready == -1) {
-                throw std::runtime_error("Error in poll!");
-            }
-            else if (!ready) {
-                throw std::runtime_error("Descriptor isn't ready!");
+void TcpConnect::ConsumeData(size_t size) {
+    if (inputEnd_ - inputBegin_ < size) {
+        throw std::runtime_error("Consumed more data than received!");
+    }
+    inputBegin_ += size;
+    if (inputBegin_ == inputEnd_) {
+        // буфер разобран целиком: следующее чтение начнется с его начала без сдвига данных
+        inputBegin_ = 0;
+        inputEnd_ = 0;
+    }
+}
+
+bool TcpConnect::ReceiveInto(char* data, size_t size, size_t& received) {
+    if (sock_status != 1) {
+        throw std::runtime_error("Socket was closed!");
+    }
+    if (inputBegin_ != inputEnd_) {
+        throw std::runtime_error("Input buffer is not empty!");
+    }
+    size_t limit = downloadLimiter_.Acquire(size);
+    receiveLimited_ = limit < size;
+    received = 0;
+    bool open = true;
+    while (received < limit) {
+        ssize_t bytes_received = recv(sock_, data + received, limit - received, 0);
+        if (bytes_received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
             }
-            else {
-                ssize_t bytes_received = recv(sock_, lenbufptr, sz, 0);
-                if (bytes_received == -1) {
-                    throw std::runtime_error("Error in recv!");
-                }
-                lenbufptr += bytes_received;
-                sz -= bytes_received;
+            if (errno == EINTR) {
+                continue;
             }
+            downloadLimiter_.Release(limit - received);
+            throw std::runtime_error("Error in recv!");
+        }
+        else if (!bytes_received) {
+            open = false;
+            break;
+        }
+        bool drained = static_cast<size_t>(bytes_received) < limit - received;
+        received += bytes_received;
+        if (drained) {
+            break;  // сокет опустел, следующий recv вернул бы EAGAIN
+        }
+    }
+    downloadLimiter_.Release(limit - received);
+    return open;
+}
+
+void TcpConnect::QueueData(std::string_view data) {
+    std::memcpy(ReserveDataToSend(data.size()), data.data(), data.size());
+}
+
+char* TcpConnect::ReserveDataToSend(size_t size) {
+    if (outputChunks_.empty() || outputChunks_.back().capacity - outputChunks_.back().end < size) {
+        if (size <= OUTPUT_CHUNK_SIZE && spareChunk_.data != nullptr) {
+            outputChunks_.push_back(std::move(spareChunk_));
+            spareChunk_ = OutputChunk();
+        }
+        else {
+            size_t capacity = std::max(size, OUTPUT_CHUNK_SIZE);
+            outputChunks_.push_back({std::make_unique<char[]>(capacity), capacity, 0, 0});
         }
-        sz = BytesToInt(len);
     }
-    else {
-        sz = bufferSize;
+    OutputChunk& chunk = outputChunks_.back();
+    char* data = chunk.data.get() + chunk.end;
+    chunk.end += size;
+    outputSize_ += size;
+    return data;
+}
+
+bool TcpConnect::FlushData(bool more) {
+    if (sock_status != 1) {
+        throw std::runtime_error("Socket was closed before the data was sent!");
     }
-    std::string data(sz, 0);
-    char* buf = &data[0];
-    while (sz > 0) {
-        int ready = poll(&fds, 1, readTimeout_.count());
-        if (ready == -1) {
-            throw std::runtime_error("Error in poll!");
+    sendLimited_ = false;
+    while (outputSize_ > 0) {
+        size_t allowed = uploadLimiter_.Acquire(outputSize_);
+        if (allowed == 0) {
+            sendLimited_ = true;
+            return false;
         }
-        else if (!ready) {
-            throw std::runtime_error("Descriptor isn't ready!");
+        iovec segments[MAX_SEND_SEGMENTS];
+        size_t count = 0;
+        size_t total = 0;
+        for (size_t i = 0; i < outputChunks_.size() && count < MAX_SEND_SEGMENTS && total < allowed; ++i) {
+            OutputChunk& chunk = outputChunks_[i];
+            size_t length = std::min(chunk.end - chunk.begin, allowed - total);
+            segments[count++] = {chunk.data.get() + chunk.begin, length};
+            total += length;
         }
-        else {
-            ssize_t bytes_received = recv(sock_, buf, sz, 0);
-            if (bytes_received == -1) {
-                throw std::runtime_error("Error in recv!");
-            } else if (!bytes_received) {
-                throw std::runtime_error("Connection closed!");
+        msghdr message{};
+        message.msg_iov = segments;
+        message.msg_iovlen = count;
+        int flags = MSG_NOSIGNAL | (more || total < outputSize_ ? MSG_MORE : 0);
+        ssize_t bytes_sent = sendmsg(sock_, &message, flags);
+        uploadLimiter_.Release(allowed - std::max<ssize_t>(bytes_sent, 0));
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            if (errno == EINTR) {
+                continue;
             }
-            buf += bytes_received;
-            sz -= bytes_received;
+            throw std::runtime_error("Error send data!");
         }
+        ConsumeOutput(bytes_sent);
     }
-    return data;
+    return true;
 }
 
-void TcpConnect::CloseConnection() {
-    if (sock_status == 1) {
-        sock_status = 2;
-        close(sock_);
+void TcpConnect::ConsumeOutput(size_t size) {
+    outputSize_ -= size;
+    while (size > 0) {
+        OutputChunk& chunk = outputChunks_.front();
+        size_t consumed = std::min(size, chunk.end - chunk.begin);
+        chunk.begin += consumed;
+        size -= consumed;
+        if (chunk.begin == chunk.end) {
+            if (chunk.capacity == OUTPUT_CHUNK_SIZE) {
+                chunk.begin = 0;
+                chunk.end = 0;
+                spareChunk_ = std::move(chunk);
+            }
+            outputChunks_.pop_front();
+        }
     }
 }
 
+void TcpConnect::ClearOutput() {
+    outputChunks_.clear();
+    outputSize_ = 0;
+}
+
+bool TcpConnect::HasDataToSend() const {
+    return outputSize_ > 0;
+}
+
+size_t TcpConnect::DataToSendSize() const {
+    return outputSize_;
+}
+
+int TcpConnect::GetSocket() const {
+    return sock_;
+}
+
 const std::string &TcpConnect::GetIp() const {
     return ip_;
 }
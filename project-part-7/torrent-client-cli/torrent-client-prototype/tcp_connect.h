@@ -1,55 +1,131 @@
 #pragma once
 
+#include "rate_limiter.h"
 #include <string>
-#include <chrono>
+#include <string_view>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
 
 /*
  * Обертка над низкоуровневой структурой сокета.
  */
 class TcpConnect {
 public:
-    TcpConnect(std::string ip, int port, std::chrono::milliseconds connectTimeout, std::chrono::milliseconds readTimeout);
+    TcpConnect(std::string ip, int port);
 
     ~TcpConnect();
 
     /*
-     * Установить tcp соединение.
-     * Если соединение занимает более `connectTimeout` времени, то прервать подключение и выбросить исключение.
-     * Полезная информация:
-     * - https://man7.org/linux/man-pages/man7/socket.7.html
-     * - https://man7.org/linux/man-pages/man2/connect.2.html
-     * - https://man7.org/linux/man-pages/man2/fcntl.2.html (чтобы включить неблокирующий режим работы операций)
-     * - https://man7.org/linux/man-pages/man2/select.2.html
-     * - https://man7.org/linux/man-pages/man2/setsockopt.2.html
-     * - https://man7.org/linux/man-pages/man2/close.2.html
-     * - https://man7.org/linux/man-pages/man3/errno.3.html
-     * - https://man7.org/linux/man-pages/man3/strerror.3.html
+     * Закрыть сокет
      */
-    void EstablishConnection();
+    void CloseConnection();
+
     /*
-     * Послать данные в сокет
-     * Полезная информация:
-     * - https://man7.org/linux/man-pages/man2/send.2.html
+     * Начать работу с уже подключенным сокетом: входящим соединением, которое вернул accept, или исходящим,
+     * которое установил PeerConnector.
+     * Сокет переводится в неблокирующий режим, объект становится его владельцем. Дальше все операции неблокирующие,
+     * их вызывает цикл событий (см. DownloadEngine)
      */
-    void SendData(const std::string& data) const;
+    void AcceptConnection(int socket);
 
     /*
-     * Прочитать данные из сокета.
-     * Если передан `bufferSize`, то прочитать `bufferSize` байт.
-     * Если параметр `bufferSize` не передан, то сначала прочитать 4 байта, а затем прочитать количество байт, равное
-     * прочитанному значению.
-     * Первые 4 байта (в которых хранится длина сообщения) интерпретируются как целое число в формате big endian,
-     * см https://wiki.theory.org/BitTorrentSpecification#Data_Types
-     * Полезная информация:
-     * - https://man7.org/linux/man-pages/man2/poll.2.html
-     * - https://man7.org/linux/man-pages/man2/recv.2.html
+     * Ограничить скорость неблокирующих чтения и отправки. Вызывается до начала обмена данными
      */
-    std::string ReceiveData(size_t bufferSize = 0) const;
+    void SetRateLimits(const RateLimits& limits);
 
     /*
-     * Закрыть сокет
+     * Есть ли сейчас токены на чтение и на отправку. Если нет, ждать готовности сокета к этой операции бессмысленно
      */
-    void CloseConnection();
+    bool CanReceive();
+
+    bool CanSend();
+
+    /*
+     * Последнее чтение было урезано ограничением скорости, то есть данные от пира, возможно, ждут в сокете
+     */
+    bool ReceiveLimited() const;
+
+    /*
+     * Последняя отправка остановилась из-за ограничения скорости, и в очереди остались данные
+     */
+    bool SendLimited() const;
+
+    /*
+     * Прочитать из сокета во внутренний буфер все данные, которые можно получить без блокировки, но не больше
+     * `maxSize` байт (и не больше внутреннего ограничения на один вызов и ограничения скорости).
+     * Данные читаются большими порциями прямо в свободный хвост буфера; если recv вернул меньше запрошенного,
+     * сокет пуст и следующий recv не делается.
+     * Возвращает false, если пир закрыл соединение (прочитанные до этого данные остаются в буфере)
+     */
+    bool ReceiveAvailable(size_t maxSize = SIZE_MAX);
+
+    /*
+     * Забрать из внутреннего буфера ровно `size` байт. Возвращает false, если столько данных еще не пришло
+     */
+    bool ExtractData(size_t size, std::string& data);
+
+    /*
+     * Забрать из внутреннего буфера одно сообщение формата "<4 байта длины><данные>", если оно пришло целиком.
+     * В `message` кладется ссылка на данные без длины внутри буфера, без копирования. Она остается валидной
+     * до следующего вызова ReceiveAvailable.
+     * Если длина сообщения больше `maxSize`, выбрасывается исключение, не дожидаясь его данных: иначе пир мог бы
+     * заставить буфер расти до 4 ГиБ под одно сообщение
+     */
+    bool ExtractMessage(std::string_view& message, size_t maxSize);
+
+    /*
+     * Данные во внутреннем буфере, которые еще не забрали. Остаются валидными до следующего вызова
+     * ReceiveAvailable
+     */
+    std::string_view BufferedData() const;
+
+    /*
+     * Убрать из внутреннего буфера первые `size` байт, которые уже разобраны через BufferedData
+     */
+    void ConsumeData(size_t size);
+
+    /*
+     * Прочитать из сокета без блокировки до `size` байт прямо в `data`, минуя внутренний буфер.
+     * Можно вызывать только когда во внутреннем буфере не осталось данных, иначе порядок байт нарушится.
+     * В `received` записывается, сколько байт прочитано. Возвращает false, если пир закрыл соединение
+     */
+    bool ReceiveInto(char* data, size_t size, size_t& received);
+
+    /*
+     * Поставить данные в очередь на отправку. Сама отправка происходит в FlushData.
+     * Очередь -- список буферов по 64 КиБ: данные дописываются в последний из них, отправленные буферы
+     * переиспользуются, поэтому при отправке данные не сдвигаются и не копируются еще раз
+     */
+    void QueueData(std::string_view data);
+
+    /*
+     * Поставить в очередь на отправку `size` байт, которые вызывающий запишет сам по возвращенному указателю,
+     * например прочитав их прямо с диска или закодировав в них сообщение. Указатель действителен до следующего
+     * вызова FlushData
+     */
+    char* ReserveDataToSend(size_t size);
+
+    /*
+     * Отправить из очереди столько данных, сколько сокет примет без блокировки и позволит ограничение скорости.
+     * Все буферы очереди отправляются одним вызовом sendmsg. `more` -- вызывающий сейчас же поставит в очередь
+     * еще данные, поэтому ядру не нужно отправлять неполный последний сегмент (MSG_MORE).
+     * Возвращает true, если очередь опустела
+     */
+    bool FlushData(bool more = false);
+
+    /*
+     * Остались ли в очереди неотправленные данные
+     */
+    bool HasDataToSend() const;
+
+    /*
+     * Сколько байт ждут отправки в очереди
+     */
+    size_t DataToSendSize() const;
+
+    int GetSocket() const;
 
     const std::string& GetIp() const;
 
@@ -58,7 +134,41 @@ public:
 private:
     const std::string ip_;
     const int port_;
-    std::chrono::milliseconds connectTimeout_, readTimeout_;
-    int sock_;
+    int sock_ = -1;
     int sock_status = 0;
+    std::vector<char> inputBuffer_;  // прочитанные данные, неразобранные лежат в [inputBegin_, inputEnd_)
+    size_t inputBegin_ = 0;
+    size_t inputEnd_ = 0;
+    /*
+     * Буфер очереди отправки, неотправленные данные лежат в [begin, end)
+     */
+    struct OutputChunk {
+        std::unique_ptr<char[]> data;
+        size_t capacity = 0;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    std::deque<OutputChunk> outputChunks_;
+    OutputChunk spareChunk_;  // опустевший буфер стандартного размера, чтобы не выделять память заново
+    size_t outputSize_ = 0;  // сколько байт ждут отправки
+    RateLimiter downloadLimiter_, uploadLimiter_;
+    bool receiveLimited_ = false;
+    bool sendLimited_ = false;
+
+    /*
+     * Освободить в хвосте входного буфера место под `size` байт: сдвинуть неразобранные данные в начало буфера
+     * или, если их слишком много, увеличить буфер
+     */
+    void ReserveInputSpace(size_t size);
+
+    /*
+     * Убрать из очереди отправки первые `size` отправленных байт
+     */
+    void ConsumeOutput(size_t size);
+
+    /*
+     * Очистить очередь отправки
+     */
+    void ClearOutput();
 };
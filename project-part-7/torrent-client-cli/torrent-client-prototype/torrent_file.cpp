@@ -1,39 +1,118 @@
 #include "torrent_file.h"
 #include "bencode.h"
+#include <cstdint>
 #include <vector>
-#include <openssl/sha.h>
 #include <fstream>
-#include <variant>
-#include <sstream>
+#include <stdexcept>
+
+namespace {
+    /*
+     * Проверить, что имя из торрента можно безопасно использовать как компонент пути внутри директории загрузки
+     */
+    std::string_view CheckPathComponent(std::string_view component) {
+        if (component.empty() || component == "." || component == ".." ||
+            component.find('/') != std::string_view::npos || component.find('\0') != std::string_view::npos) {
+            throw std::invalid_argument("Bad file path in torrent file!");
+        }
+        return component;
+    }
+
+    /*
+     * Значение строкового поля `key` словаря `dict`. Если поле не строка, выбрасывается исключение
+     */
+    std::string_view GetString(const Bencode::Document& document, const Bencode::NodeView& dict, std::string_view key) {
+        const Bencode::NodeView& node = document.Get(dict, key);
+        if (node.type != Bencode::NodeView::Type::String) {
+            throw std::invalid_argument("Bad " + std::string(key) + " in torrent file!");
+        }
+        return node.string;
+    }
+
+    /*
+     * Значение целого положительного поля `key` словаря `dict`. Иначе выбрасывается исключение
+     */
+    size_t GetPositiveInt(const Bencode::Document& document, const Bencode::NodeView& dict, std::string_view key) {
+        const Bencode::NodeView& node = document.Get(dict, key);
+        if (node.type != Bencode::NodeView::Type::Int || node.integer <= 0) {
+            throw std::invalid_argument("Bad " + std::string(key) + " in torrent file!");
+        }
+        return static_cast<size_t>(node.integer);
+    }
+
+    /*
+     * Разобрать список info.files многофайлового торрента
+     */
+    void LoadFiles(const Bencode::Document& document, const Bencode::NodeView& files, TorrentFile& tf) {
+        size_t offset = 0;
+        document.ForEachChild(files, [&] (const Bencode::NodeView& file) {
+            const Bencode::NodeView& length = document.Get(file, "length");
+            if (length.type != Bencode::NodeView::Type::Int || length.integer < 0) {
+                throw std::invalid_argument("Bad file length in torrent file!");
+            }
+            std::filesystem::path path = CheckPathComponent(tf.name);
+            size_t components = 0;
+            document.ForEachChild(document.Get(file, "path"), [&] (const Bencode::NodeView& component) {
+                if (component.type != Bencode::NodeView::Type::String) {
+                    throw std::invalid_argument("Bad file path in torrent file!");
+                }
+                path /= CheckPathComponent(component.string);
+                ++components;
+            });
+            if (components == 0) {
+                throw std::invalid_argument("Bad file path in torrent file!");
+            }
+            // файлы лежат в общем потоке байт подряд, переполнение суммы дало бы пересекающиеся файлы
+            if (static_cast<uint64_t>(length.integer) > static_cast<uint64_t>(INT64_MAX) - offset) {
+                throw std::invalid_argument("Total length of files is too big in torrent file!");
+            }
+            tf.files.push_back({path, static_cast<size_t>(length.integer), offset});
+            offset += length.integer;
+        });
+        tf.length = offset;
+    }
+}
 
 TorrentFile LoadTorrentFile(const std::string& filename) {
-    std::ifstream read_file(filename, std::ios::binary);
+    std::ifstream read_file(filename, std::ios::binary | std::ios::ate);
     if (!read_file.is_open()) {
-        perror("read_file");
+        throw std::invalid_argument("Cannot open torrent file " + filename);
     }
 
-    std::stringstream buffer;
-    buffer << read_file.rdbuf();
-    std::string data = buffer.str();
+    std::string data(static_cast<size_t>(read_file.tellg()), '\0');
+    read_file.seekg(0);
+    read_file.read(data.data(), data.size());
+    read_file.close();
 
     TorrentFile tf;
 
-    size_t cur_pos = 0;
-    size_t len = data.size();
+    Bencode::Document document(data);
+    const Bencode::NodeView& root = document.Root();
+    const Bencode::NodeView& info = document.Get(root, "info");
 
-    std::shared_ptr<NodeDict> dict = std::dynamic_pointer_cast<NodeDict>(Bencode::Parse(cur_pos, len, data));
-
-    tf.announce = std::dynamic_pointer_cast<NodeString>(dict->GetKeyValue("announce"))->GetValue();
-    tf.comment = std::dynamic_pointer_cast<NodeString>(dict->GetKeyValue("comment"))->GetValue();
-    tf.pieceLength = std::stoul(std::dynamic_pointer_cast<NodeInt>(std::dynamic_pointer_cast<NodeDict>(dict->GetKeyValue("info"))->GetKeyValue("piece length"))->GetValue());
-    tf.length = std::stoul(std::dynamic_pointer_cast<NodeInt>(std::dynamic_pointer_cast<NodeDict>(dict->GetKeyValue("info"))->GetKeyValue("length"))->GetValue());
-    tf.name = std::dynamic_pointer_cast<NodeString>(std::dynamic_pointer_cast<NodeDict>(dict->GetKeyValue("info"))->GetKeyValue("name"))->GetValue();
-
-    tf.pieceHashes = Bencode::GetPieceHashes(dict);
+    tf.announce = GetString(document, root, "announce");
+    if (document.Find(root, "comment") != nullptr) {
+        tf.comment = GetString(document, root, "comment");
+    }
+    tf.pieceLength = GetPositiveInt(document, info, "piece length");
+    tf.name = GetString(document, info, "name");
+    if (const Bencode::NodeView* files = document.Find(info, "files")) {
+        LoadFiles(document, *files, tf);
+    }
+    else {
+        tf.length = GetPositiveInt(document, info, "length");
+        tf.files.push_back({CheckPathComponent(tf.name), tf.length, 0});
+    }
+    if (tf.pieceLength == 0 || tf.length == 0) {
+        throw std::invalid_argument("Empty torrent file!");
+    }
 
-    tf.infoHash = Bencode::GetInfoHash(dict);
+    tf.pieceHashes = Bencode::GetPieceHashes(GetString(document, info, "pieces"));
+    // длина последней части считается как length - index * pieceLength, лишний хеш дал бы переполнение
+    if (tf.pieceHashes.size() != tf.length / tf.pieceLength + (tf.length % tf.pieceLength != 0)) {
+        throw std::invalid_argument("Number of piece hashes does not match file length in torrent file!");
+    }
 
-    read_file.close();
+    tf.infoHash = Bencode::GetInfoHash(document);
 
     return tf;
-}
\ No newline at end of file
+}
@@ -1,16 +1,28 @@
 #pragma once
 
+#include "byte_tools.h"
+#include <filesystem>
 #include <string>
 #include <vector>
 
+/*
+ * Один файл из торрента. Все файлы торрента идут подряд в одном непрерывном потоке байт, который режется на части
+ */
+struct TorrentFileEntry {
+    std::filesystem::path path;  // путь относительно директории для скачивания, для многофайлового торрента -- name/...
+    size_t length;
+    size_t offset;  // смещение начала файла в общем потоке байт торрента
+};
+
 struct TorrentFile {
     std::string announce;
     std::string comment;
-    std::vector<std::string> pieceHashes;
+    std::vector<Sha1Hash> pieceHashes;  // хеш-суммы частей, лежат в памяти одним непрерывным блоком
     size_t pieceLength;
-    size_t length;
+    size_t length;  // суммарная длина всех файлов
     std::string name;
     std::string infoHash;
+    std::vector<TorrentFileEntry> files;  // у однофайлового торрента -- один файл с именем name
 };
 
 TorrentFile LoadTorrentFile(const std::string& filename);